@@ -3,282 +3,1440 @@ Ryan Sario
 Section: 01
 OS: macOS
 */
+#define _GNU_SOURCE // CPU affinity and getcpu on Linux
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <sys/timeb.h>
 #include <semaphore.h>
+#include <string.h>
 #include <stdbool.h> // This enables the use of bool in C
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // AVX2/AVX-512 intrinsics, only used behind CPU dispatch
+#endif
+#include "completion.h"
+#include "reduce.h"
+#include "bench.h"
 
-#define MAX_SIZE 100000000
-#define MAX_THREADS 16
 #define RANDOM_SEED 7649
 #define MAX_RANDOM_NUMBER 3000
 #define NUM_LIMIT 9973
+#define CACHE_LINE 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Elements per task: 16K ints (64 KB) stay in L2 while one worker multiplies
+// them, and 100M elements still make thousands of tasks to balance
+#define TASK_SIZE 16384
+
+// Barrett reduction constants: x mod NUM_LIMIT = x - ((x * BARRETT_M) >> BARRETT_SHIFT) * NUM_LIMIT,
+// off by at most one NUM_LIMIT, for any x < NUM_LIMIT^2
+#define BARRETT_SHIFT 40
+#define BARRETT_M ((1ULL << BARRETT_SHIFT) / NUM_LIMIT)
+
+// Philox4x32-10 counter-based generator (Salmon et al., SC'11): element i of
+// the input depends only on RANDOM_SEED and i, so any thread can make any part
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+#define PHILOX_LANES 16 // Counters run side by side in one vector step, enough to hide the multiply latency
+#define GEN_GROUP (4 * PHILOX_LANES) // Elements one vector step produces
+
+// FNV-1a, for comparing generated arrays
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+// Elements of an input file mapped at a time (64 MB): a whole number of tasks
+// and of pages, and big enough that each window keeps every worker busy
+#define STREAM_WINDOW (16 * 1024 * 1024)
+_Static_assert(STREAM_WINDOW % TASK_SIZE == 0, "A stream window must be a whole number of tasks");
+
+// Product index (-i): a segment tree of products mod NUM_LIMIT whose leaves
+// are INDEX_LEAF elements, so the tree is 1/32 the size of the array and a
+// leaf is recomputed with one short kernel call. Each task builds the
+// INDEX_BLOCK_LEAVES leaves of its elements and the subtree above them.
+#define INDEX_LEAF 64
+#define INDEX_BLOCK_LEAVES (TASK_SIZE / INDEX_LEAF)
+_Static_assert((INDEX_BLOCK_LEAVES & (INDEX_BLOCK_LEAVES - 1)) == 0, "A task's leaves must be a whole subtree");
+_Static_assert(NUM_LIMIT <= 65536, "Index nodes are 16 bits");
+
+// Elements the SIMD kernels multiply between checks for a zero
+#define ZERO_CHECK_BLOCK 4096
+
+// The SIMD kernels multiply an accumulator (< NUM_LIMIT) by a raw element in
+// 32 bits before reducing, so every element must already be below NUM_LIMIT
+_Static_assert(MAX_RANDOM_NUMBER < NUM_LIMIT, "SIMD product kernels need elements below NUM_LIMIT");
+
+// What the workers do with each task
+typedef enum { JOB_REDUCE, JOB_ZERO_SCAN, JOB_GENERATE, JOB_INDEX } JobKind;
+
+// Philox state, PHILOX_LANES counters per vector (GCC/Clang vector extensions, any target)
+typedef uint32_t PhiloxVec __attribute__((vector_size(PHILOX_LANES * sizeof(uint32_t))));
+typedef uint64_t PhiloxWide __attribute__((vector_size(PHILOX_LANES * sizeof(uint64_t))));
+
+// A worker's queue of tasks. Tasks are numbered in array order and a deque is
+// always the contiguous range [head, tail): the owner takes from the head,
+// a thief splits off the upper half.
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    int head;
+    int tail;
+} TaskDeque;
+
+// What one worker did during the measured job, for the per-node bandwidth report
+typedef struct {
+    _Alignas(CACHE_LINE) long bytes;
+    long busyNs;
+    int node; // NUMA node the worker is pinned to, -1 if unknown
+} WorkerStat;
 
 // Global variables
-long gRefTime; // For timing
-int gData[MAX_SIZE]; // The array that will hold the data
+long gRefTime; // For timing, in ns
+int* gData; // The array that will hold the data, mapped at exactly the requested size
+size_t gDataBytes; // Size of the mapping, rounded up to a huge page when they are used
+bool gHugePages; // Back gData with huge pages (-H)
+int gArraySize; // Number of elements in use
 int gThreadCount; // Number of threads
 int gDoneThreadCount; // Number of threads that are done at a certain point
-int gThreadProd[MAX_THREADS]; // The modular product for each array division that a single thread is responsible for
-bool gThreadDone[MAX_THREADS]; // Is this thread done? Used when the parent is continually checking on child threads
+int gTaskCount; // Number of TASK_SIZE tasks the array is split into
+ReduceOp* gOp; // Operator the experiments reduce the array with (-o), the modular product by default
+ReduceAcc* gWorkerAccs; // Each worker's accumulator, valid once its slot is done
+ResultSlot* gSlots; // Whether each worker is done (the busy-wait experiment polls these)
+Latch gLatch; // Released by the last worker or the first zero in the latch experiment
+int gOnlyMode = -1; // Only run this threaded experiment (-w), -1 for all of them
+
+// Worker pool, created once and reused by every threaded experiment
+pthread_t* gWorkers;
+TaskDeque* gDeques;
+WorkerStat* gWorkerStats;
+pthread_mutex_t gPoolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gPoolWake = PTHREAD_COND_INITIALIZER; // A job was posted or the pool is stopping
+pthread_cond_t gPoolIdle = PTHREAD_COND_INITIALIZER; // The last busy worker finished its job
+int gJobGen; // Bumped for every job, so workers can tell a new one from a spurious wakeup
+int gBusyWorkers; // Workers still on the current job
+bool gPoolStop; // Set once to make the workers exit
+WaitMode gWaitMode; // How the current job reports back to the parent
+JobKind gJobKind; // What the current job computes
+atomic_bool gCancel; // A task found a zero (the operator's absorbing value): the job's answer is known, so the workers stop taking tasks
+bool gZeroScan; // Look for a zero before multiplying anything (-z)
+bool gCheckGen; // Check the generated array against other thread counts (-c)
+const char* gInputPath; // Stream the input from this file instead of generating it (-f)
+bool gRawRead; // Time a plain read of the input file too, for comparison (-r)
+int gBenchTrials; // Benchmark mode (-b): timed trials of each variant, 0 for the normal experiments
+int gIndexQueries; // Index benchmark (-i): queries per update ratio, 0 for the normal experiments
+uint16_t* gIndex; // Product index, in Eytzinger order: node i's children are 2i and 2i + 1, leaf l is node gIndexLeaves + l
+int gIndexLeaves; // Leaves of the index, a power of two and at least INDEX_BLOCK_LEAVES
 
 // Semaphores
 sem_t completed; // To notify parent that all threads have completed or one of them found a zero
 sem_t mutex; // Binary semaphore to protect the shared variable gDoneThreadCount
 
 // Function declarations
-int SqFindProd(int size); // Sequential FindProduct (no threads)
-void *ThFindProd(void *param); // Thread FindProduct without semaphores
-void *ThFindProdWithSemaphore(void *param); // Thread FindProduct with semaphores
-int ComputeTotalProduct(); // Multiply the division products to compute the total modular product
+void SqReduce(int size, ReduceAcc* acc); // Sequential reduction (no threads)
+void AllocData(int size); // Map gData at exactly size elements, on huge pages if asked
+void FreeData(); // Unmap gData
+void StartPool(int arraySize); // Split the array into tasks and create the worker threads
+void PinWorker(int worker); // Pin a worker to one CPU and note its NUMA node
+void ResetWorkerStats(); // Start a new per-node bandwidth measurement
+void PrintNodeBandwidth(const char* what); // Report the bandwidth each NUMA node reached since the reset
+void RunJob(JobKind kind, WaitMode mode); // Deal the tasks out to the workers and wake them
+bool ParScanForZero(); // Zero-scan pre-pass on the pool: is there a zero anywhere?
+void WaitForPool(); // Wait until every worker is done with the current job
+void StopPool(); // Make the workers exit and join them
+void *PoolWorker(void *param); // Worker thread: runs one job per generation
+int TakeTask(int worker); // Next task for a worker, stealing if its deque is empty, -1 if none are left
+void NoteWorkerDone(); // Report a worker's end of job the way the current experiment expects
+void RunExperiment(WaitMode mode); // Time one threaded reduction, the parent waiting the given way
+long ThreadedReduce(WaitMode mode, ReduceAcc* total); // One threaded reduction; ns from posting the job to having the result
+void RunBenchmark(int trials); // Benchmark mode: summaries of repeated runs of every variant
 void InitSharedVars(); // Initialize shared variables
-void GenerateInput(int size, int indexForZero); // Generate the input array
-void CalculateIndices(int arraySize, int thrdCnt, int indices[MAX_THREADS][3]); // Calculate the indices to divide the array into T divisions
-int GetRand(int min, int max); // Get a random number between min and max
+void GenerateInput(int size, int indexForZero); // Generate the input array on the pool
+void GenerateRange(int* out, long first, int len); // Elements [first, first + len) of the input
+void GenerateGroup(long group, int* out); // One Philox vector step: elements of GEN_GROUP-aligned group
+uint64_t HashInts(uint64_t hash, const int* data, long len); // Continue an FNV-1a hash over len ints
+void CheckGeneration(); // Compare gData with the same input made by other thread counts
+void RunStreamed(const char* path, long count); // Reduce an input file a window at a time on the pool
+int* MapWindow(int fd, long first, long elems); // Map the window of the file starting at element first, read in
+double MeasureRawRead(int fd, long bytes); // GB/s of a plain cold read of the file's first bytes
+void IndexBuild(); // Build the product index over gData on the pool
+void IndexBuildBlock(int task); // Leaves of one task's elements and the subtree above them
+int IndexLeafProd(int leaf); // Product of one leaf's elements
+void IndexUpdate(int i, int value); // Set gData[i] and update the index, O(log n)
+void IndexUpdateBatch(int* idx, const int* values, int cnt); // Set many elements, each node recomputed once; sorts idx
+int IndexQuery(int l, int r); // Product of gData[l..r] mod NUM_LIMIT
+void RunIndexBenchmark(int queries); // Index against rescans at several numbers of updates per query
+
+// Modular product kernels: product of len elements mod NUM_LIMIT, 0 if any is zero
+int ProdKernel(const int* data, int len); // Calls the best kernel for this CPU
+int ProdScalar(const int* data, int len); // One element at a time, the original loop
+int ProdAvx2(const int* data, int len);
+int ProdAvx512(const int* data, int len);
+void SelectProdKernel(void); // Pick the kernels once, from the CPU's features
+void ProdModSimdBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len); // prodmod's block on ProdKernel
+void ProdModCheckedBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len); // The same for elements of any value
+
+// Zero-scan kernels: does any of the len elements equal zero? No multiplications.
+bool HasZero(const int* data, int len); // Calls the best kernel for this CPU
+bool ZeroScalar(const int* data, int len);
+bool ZeroAvx2(const int* data, int len);
+bool ZeroAvx512(const int* data, int len);
 
 // Timing functions
-long GetMilliSecondTime(struct timeb timeBuf);
-long GetCurrentTime(void);
 void SetTime(void);
 long GetTime(void);
 
 int main(int argc, char *argv[]) {
-    pthread_t tid[MAX_THREADS];
-    pthread_attr_t attr[MAX_THREADS];
-    int indices[MAX_THREADS][3];
-    int i, indexForZero, arraySize, prod;
+    int i, indexForZero, arraySize;
+    ReduceAcc seq;
+    char result[REDUCE_MAX_WIDTH * 24];
 
-    // Code for parsing and checking command-line arguments
-    if (argc != 4) {
+    // Code for parsing and checking command-line arguments; optional trailing
+    // flags: -z turns on the zero-scan pre-pass, -H asks for huge pages,
+    // -c checks the generated input against other thread counts,
+    // -w join|busy|sem|latch runs only that threaded experiment,
+    // -o prodmod|sum|min|max|xor|hist picks what the array is reduced with,
+    // -f file reduces a file of native ints instead (size 0 for all of it)
+    // and -r also times a plain read of that file, -b trials benchmarks
+    // every variant over that many runs instead of timing each once,
+    // -i queries benchmarks the product index against rescans instead
+    if (argc < 4) {
         fprintf(stderr, "Invalid number of arguments!\n");
         exit(-1);
     }
-    if ((arraySize = atoi(argv[1])) <= 0 || arraySize > MAX_SIZE) {
+    for (i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-z") == 0) {
+            gZeroScan = true;
+        } else if (strcmp(argv[i], "-H") == 0) {
+            gHugePages = true;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            gCheckGen = true;
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc && (gOnlyMode = ParseWaitMode(argv[i + 1])) >= 0) {
+            i++;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && (gOp = ReduceFindOp(argv[i + 1])) != NULL) {
+            i++;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            gInputPath = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            gRawRead = true;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc && (gBenchTrials = atoi(argv[i + 1])) > 0) {
+            i++;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc && (gIndexQueries = atoi(argv[i + 1])) > 0) {
+            i++;
+        } else {
+            fprintf(stderr, "Invalid option %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    if (gInputPath != NULL ? (gHugePages || gCheckGen || gOnlyMode >= 0 || gBenchTrials > 0 || gIndexQueries > 0) : gRawRead) {
+        fprintf(stderr, "-H, -c, -w, -b and -i only apply to generated input, -r only to -f\n");
+        exit(-1);
+    }
+    if (gBenchTrials > 0 && gIndexQueries > 0) {
+        fprintf(stderr, "-b and -i are separate benchmarks, pick one\n");
+        exit(-1);
+    }
+    if (gOp == NULL) {
+        gOp = ReduceFindOp("prodmod");
+    }
+    if ((gZeroScan || gIndexQueries > 0) && gOp != ReduceFindOp("prodmod")) {
+        fprintf(stderr, "-z and -i only apply to the product\n");
+        exit(-1);
+    }
+    long size = strtol(argv[1], NULL, 10);
+    if (size < 0 || (gInputPath == NULL && (size == 0 || size > INT_MAX))) {
         fprintf(stderr, "Invalid Array Size\n");
         exit(-1);
     }
+    arraySize = size > INT_MAX ? INT_MAX : (int)size; // Only used with generated input
     gThreadCount = atoi(argv[2]);
-    if (gThreadCount > MAX_THREADS || gThreadCount <= 0) {
+    if (gThreadCount <= 0) {
         fprintf(stderr, "Invalid Thread Count\n");
         exit(-1);
     }
     indexForZero = atoi(argv[3]);
-    if (indexForZero < -1 || indexForZero >= arraySize) {
+    if (indexForZero < -1 || indexForZero >= size || (gInputPath != NULL && indexForZero != -1)) {
         fprintf(stderr, "Invalid index for zero!\n");
         exit(-1);
     }
 
-    GenerateInput(arraySize, indexForZero);
-    CalculateIndices(arraySize, gThreadCount, indices);
+    SelectProdKernel();
+    ReduceConfigure(NUM_LIMIT, MAX_RANDOM_NUMBER);
+    if (gInputPath != NULL) {
+        ReduceFindOp("prodmod")->block = ProdModCheckedBlock; // A file's elements can be anything
+        StartPool(0);
+        if (gZeroScan) {
+            printf("Zero-scan pre-pass enabled\n");
+        }
+        RunStreamed(gInputPath, size);
+        StopPool();
+        return 0;
+    }
+    ReduceFindOp("prodmod")->block = ProdModSimdBlock;
 
-    // Sequential multiplication
+    AllocData(arraySize);
+    StartPool(arraySize); // Threads are created here, outside the timed sections
     SetTime();
-    prod = SqFindProd(arraySize);
-    printf("Sequential multiplication completed in %ld ms. Product = %d\n", GetTime(), prod);
+    GenerateInput(arraySize, indexForZero);
+    printf("Input of %d elements generated in %ld ms\n", arraySize, GetTime());
+    if (gZeroScan) {
+        printf("Zero-scan pre-pass enabled\n");
+    }
+    if (gBenchTrials > 0 || gIndexQueries > 0) {
+        if (gBenchTrials > 0) {
+            RunBenchmark(gBenchTrials);
+        } else {
+            RunIndexBenchmark(gIndexQueries);
+        }
+        StopPool();
+        FreeData();
+        return 0;
+    }
 
-    // Threaded with parent waiting for all child threads
-    InitSharedVars();
+    // Sequential reduction
     SetTime();
-    
-    // Initialize threads and create threads, wait for all using pthread_join
-    for (i = 0; i < gThreadCount; i++) {
-        pthread_attr_init(&attr[i]);
-        pthread_create(&tid[i], &attr[i], ThFindProd, (void*)indices[i]);
+    SqReduce(arraySize, &seq);
+    long ms = GetTime();
+    ReduceFormat(gOp, &seq, result, sizeof(result));
+    printf("Sequential %s completed in %ld ms. %s = %s\n", gOp->task, ms, gOp->label, result);
+
+    // Threaded reduction, once for each way the parent can wait
+    for (int mode = 0; mode < WAIT_MODES; mode++) {
+        if (gOnlyMode < 0 || gOnlyMode == mode) {
+            RunExperiment(mode);
+        }
     }
-    for (i = 0; i < gThreadCount; i++) {
-        pthread_join(tid[i], NULL);
+
+    // Cleanup
+    StopPool();
+    FreeData();
+    return 0;
+}
+
+// Sequential reduction (no threads)
+void SqReduce(int size, ReduceAcc* acc) {
+    ReduceInit(gOp, acc);
+    if (gZeroScan && HasZero(gData, size)) {
+        acc->v[0] = 0;
+        return;
+    }
+    ReduceRange(gOp, acc, gData, size);
+}
+
+// Map gData at exactly size elements. With -H, try reserved huge pages first
+// and fall back to asking for transparent huge pages.
+void AllocData(int size) {
+    gDataBytes = (size_t)size * sizeof(int);
+    gData = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (gHugePages) {
+        gDataBytes = (gDataBytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        gData = mmap(NULL, gDataBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        printf("Huge pages: %s\n", gData != MAP_FAILED ? "reserved (MAP_HUGETLB)" : "none reserved, using transparent huge pages");
+    }
+#endif
+    if (gData == MAP_FAILED) {
+        gData = mmap(NULL, gDataBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (gData == MAP_FAILED) {
+            fprintf(stderr, "Failed to allocate %zu bytes for the array\n", gDataBytes);
+            exit(-1);
+        }
+#ifdef MADV_HUGEPAGE
+        if (gHugePages) {
+            madvise(gData, gDataBytes, MADV_HUGEPAGE);
+        }
+#endif
     }
-    prod = ComputeTotalProduct();
-    printf("Threaded multiplication with parent waiting for all children completed in %ld ms. Product = %d\n", GetTime(), prod);
+}
+
+void FreeData() {
+    munmap(gData, gDataBytes);
+}
+
+// Time one threaded reduction, with the parent waiting for the pool the given way
+void RunExperiment(WaitMode mode) {
+    ReduceAcc total;
+    char result[REDUCE_MAX_WIDTH * 24];
+    long ns = ThreadedReduce(mode, &total);
+
+    ReduceFormat(gOp, &total, result, sizeof(result));
+    printf("Threaded %s with parent %s completed in %ld ms. %s = %s\n", gOp->task, gWaitModeHow[mode],
+           ns / 1000000, gOp->label, result);
+    if (mode == WAIT_JOIN) {
+        PrintNodeBandwidth(gWaitModeHow[mode]);
+    }
+}
+
+// One threaded reduction with the parent waiting the given way. The time runs
+// from posting the job to having the merged result; the workers already exist.
+long ThreadedReduce(WaitMode mode, ReduceAcc* total) {
+    int i;
 
-    // Multi-threaded with busy waiting
     InitSharedVars();
-    SetTime();
-    
-    // Initialize threads without semaphores, busy waiting
-    for (i = 0; i < gThreadCount; i++) {
-        pthread_attr_init(&attr[i]);
-        pthread_create(&tid[i], &attr[i], ThFindProd, (void*)indices[i]);
+    if (mode == WAIT_SEMAPHORE) {
+        sem_init(&completed, 0, 0);
+        sem_init(&mutex, 0, 1);
     }
-    // Busy waiting loop
+    ResetWorkerStats();
+    long start = GetNanoTime();
+
+    if (gZeroScan && ParScanForZero()) {
+        ReduceInit(gOp, total);
+        total->v[0] = 0;
+    } else {
+        RunJob(JOB_REDUCE, mode);
+        switch (mode) {
+        case WAIT_JOIN:
+            // Wait until every worker is idle again
+            WaitForPool();
+            break;
+        case WAIT_BUSY:
+            // Busy waiting loop on the workers' done flags
+            while (1) {
+                int allDone = 1;
+                for (i = 0; i < gThreadCount; i++) {
+                    if (!SlotDone(&gSlots[i])) { // Check if any thread is still working
+                        allDone = 0;
+                        break;
+                    }
+                }
+                if (allDone) break; // Break out of loop if all threads are done
+            }
+            break;
+        case WAIT_SEMAPHORE:
+            // The first zero or the last worker posts completed
+            sem_wait(&completed);
+            break;
+        default:
+            // The first zero or the last worker releases the latch
+            LatchWait(&gLatch);
+            break;
+        }
+        ReduceMerge(gOp, gWorkerAccs, gSlots, gThreadCount, total);
+    }
+    long ns = GetNanoTime() - start;
+
+    WaitForPool(); // The workers may still be on their way back to sleep, or off the semaphores
+    if (mode == WAIT_SEMAPHORE) {
+        sem_destroy(&completed);
+        sem_destroy(&mutex);
+    }
+    return ns;
+}
+
+// Benchmark mode: BENCH_WARMUPS untimed runs, then trials timed ones, of the
+// sequential reduction and of each threaded experiment (only -w's if given),
+// with one summary line per variant
+void RunBenchmark(int trials) {
+    long* ns = malloc(trials * sizeof(long));
+    ReduceAcc acc;
+    char result[REDUCE_MAX_WIDTH * 24];
+    char variant[32];
+
+    if (ns == NULL) {
+        fprintf(stderr, "Failed to allocate the benchmark trials\n");
+        exit(-1);
+    }
+    for (int v = -1; v < WAIT_MODES; v++) { // -1 is the sequential reduction
+        if (v >= 0 && gOnlyMode >= 0 && gOnlyMode != v) {
+            continue;
+        }
+        for (int t = -BENCH_WARMUPS; t < trials; t++) {
+            long d;
+
+            if (v < 0) {
+                long start = GetNanoTime();
+                SqReduce(gArraySize, &acc);
+                d = GetNanoTime() - start;
+            } else {
+                d = ThreadedReduce(v, &acc);
+            }
+            if (t >= 0) ns[t] = d;
+        }
+        ReduceFormat(gOp, &acc, result, sizeof(result));
+        if (v < 0) {
+            snprintf(variant, sizeof(variant), "sequential");
+        } else {
+            snprintf(variant, sizeof(variant), "threads-%s", gWaitModeNames[v]);
+        }
+        PrintBenchmark(variant, v < 0 ? 1 : gThreadCount, gArraySize, ns, trials, gOp->label, result);
+    }
+    free(ns);
+}
+
+// Split the array into tasks and create the worker threads
+void StartPool(int arraySize) {
+    gArraySize = arraySize;
+    gTaskCount = (arraySize + TASK_SIZE - 1) / TASK_SIZE;
+    gSlots = aligned_alloc(CACHE_LINE, gThreadCount * sizeof(ResultSlot));
+    gWorkerAccs = aligned_alloc(CACHE_LINE, gThreadCount * sizeof(ReduceAcc));
+    gWorkers = malloc(gThreadCount * sizeof(pthread_t));
+    gDeques = aligned_alloc(CACHE_LINE, gThreadCount * sizeof(TaskDeque));
+    gWorkerStats = aligned_alloc(CACHE_LINE, gThreadCount * sizeof(WorkerStat));
+    if (gSlots == NULL || gWorkerAccs == NULL || gWorkers == NULL || gDeques == NULL || gWorkerStats == NULL) {
+        fprintf(stderr, "Failed to allocate the worker pool\n");
+        exit(-1);
+    }
+    for (int w = 0; w < gThreadCount; w++) {
+        gWorkerStats[w].node = -1;
+        pthread_mutex_init(&gDeques[w].lock, NULL);
+        gDeques[w].head = gDeques[w].tail = 0;
+        if (pthread_create(&gWorkers[w], NULL, PoolWorker, (void*)(intptr_t)w) != 0) {
+            fprintf(stderr, "Failed to create worker thread\n");
+            exit(-1);
+        }
+    }
+}
+
+// Deal each worker an equal contiguous share of the tasks, then wake them.
+// The shares are only a starting point, stealing evens out the rest.
+void RunJob(JobKind kind, WaitMode mode) {
+    pthread_mutex_lock(&gPoolLock);
+    for (int w = 0; w < gThreadCount; w++) {
+        long first, end;
+
+        ReducePartition(gTaskCount, gThreadCount, w, &first, &end);
+        pthread_mutex_lock(&gDeques[w].lock);
+        gDeques[w].head = (int)first;
+        gDeques[w].tail = (int)end;
+        pthread_mutex_unlock(&gDeques[w].lock);
+    }
+    gJobKind = kind;
+    gWaitMode = mode;
+    atomic_store(&gCancel, false);
+    gBusyWorkers = gThreadCount;
+    gJobGen++;
+    pthread_cond_broadcast(&gPoolWake);
+    pthread_mutex_unlock(&gPoolLock);
+}
+
+// Wait until every worker is done with the current job
+void WaitForPool() {
+    pthread_mutex_lock(&gPoolLock);
+    while (gBusyWorkers > 0) {
+        pthread_cond_wait(&gPoolIdle, &gPoolLock);
+    }
+    pthread_mutex_unlock(&gPoolLock);
+}
+
+// Make the workers exit and join them
+void StopPool() {
+    pthread_mutex_lock(&gPoolLock);
+    gPoolStop = true;
+    pthread_cond_broadcast(&gPoolWake);
+    pthread_mutex_unlock(&gPoolLock);
+    for (int w = 0; w < gThreadCount; w++) {
+        pthread_join(gWorkers[w], NULL);
+    }
+    free(gSlots);
+    free(gWorkerAccs);
+    free(gWorkers);
+    free(gDeques);
+    free(gWorkerStats);
+}
+
+// Pin worker w to the w-th CPU this process may run on (wrapping around) and
+// note the node that CPU belongs to
+void PinWorker(int worker) {
+#ifdef __linux__
+    cpu_set_t allowed, one;
+    unsigned int cpu, node;
+    int nth = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    nth = worker % CPU_COUNT(&allowed);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed) && nth-- == 0) {
+            CPU_ZERO(&one);
+            CPU_SET(c, &one);
+            pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+            break;
+        }
+    }
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        gWorkerStats[worker].node = (int)node;
+    }
+#else
+    (void)worker;
+#endif
+}
+
+void ResetWorkerStats() {
+    for (int w = 0; w < gThreadCount; w++) {
+        gWorkerStats[w].bytes = 0;
+        gWorkerStats[w].busyNs = 0;
+    }
+}
+
+// Bytes each node's workers read, over the longest time one of them was busy
+void PrintNodeBandwidth(const char* what) {
+    int maxNode = -1;
+
+    for (int w = 0; w < gThreadCount; w++) {
+        if (gWorkerStats[w].node > maxNode) maxNode = gWorkerStats[w].node;
+    }
+    for (int n = (maxNode < 0 ? -1 : 0); n <= maxNode; n++) {
+        long bytes = 0, busyNs = 0;
+        int workers = 0;
+
+        for (int w = 0; w < gThreadCount; w++) {
+            if (gWorkerStats[w].node != n) continue;
+            workers++;
+            bytes += gWorkerStats[w].bytes;
+            if (gWorkerStats[w].busyNs > busyNs) busyNs = gWorkerStats[w].busyNs;
+        }
+        if (workers == 0) continue;
+        printf("  Node %d, %s: %d worker(s), %.1f MB in %.1f ms, %.2f GB/s\n", n, what, workers,
+               bytes / 1e6, busyNs / 1e6, busyNs > 0 ? (double)bytes / busyNs : 0.0);
+    }
+}
+
+// Worker thread: sleeps until a job is posted, runs tasks until none are left
+// anywhere, reports back and sleeps again
+void* PoolWorker(void *param) {
+    int worker = (int)(intptr_t)param;
+    int seenGen = 0;
+    struct timespec t0, t1;
+
+    PinWorker(worker);
+
     while (1) {
-        int allDone = 1;
-        for (i = 0; i < gThreadCount; i++) {
-            if (!gThreadDone[i]) { // Check if any thread is still working
-                allDone = 0;
-                break;
+        pthread_mutex_lock(&gPoolLock);
+        while (!gPoolStop && gJobGen == seenGen) {
+            pthread_cond_wait(&gPoolWake, &gPoolLock);
+        }
+        if (gPoolStop) {
+            pthread_mutex_unlock(&gPoolLock);
+            break;
+        }
+        seenGen = gJobGen;
+        pthread_mutex_unlock(&gPoolLock);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        long bytes = 0;
+        ReduceAcc acc; // Kept local so the hot loop doesn't write to shared memory
+        bool published = false;
+
+        ReduceInit(gOp, &acc);
+        // Task boundaries are the cancellation points: once any worker has
+        // found a zero the rest stop within one task's worth of work
+        int task;
+        while (!atomic_load_explicit(&gCancel, memory_order_relaxed) && (task = TakeTask(worker)) >= 0) {
+            long start = (long)task * TASK_SIZE;
+            int len = start + TASK_SIZE <= gArraySize ? TASK_SIZE : (int)(gArraySize - start);
+            bool zero = false;
+
+            if (gJobKind == JOB_GENERATE) {
+                GenerateRange(&gData[start], start, len);
+            } else if (gJobKind == JOB_ZERO_SCAN) {
+                zero = HasZero(&gData[start], len);
+            } else if (gJobKind == JOB_INDEX) {
+                IndexBuildBlock(task);
+            } else {
+                gOp->block(gOp, &acc, &gData[start], len);
+                zero = ReduceAbsorbed(gOp, &acc);
+            }
+            if (zero) {
+                atomic_store_explicit(&gCancel, true, memory_order_relaxed);
+                if (gJobKind == JOB_REDUCE) {
+                    gWorkerAccs[worker] = acc; // Before the parent can be told
+                    SlotPublish(&gSlots[worker], 0);
+                    published = true;
+                }
+                if (gWaitMode == WAIT_SEMAPHORE) {
+                    sem_post(&completed); // Notify parent immediately
+                } else if (gWaitMode == WAIT_LATCH) {
+                    LatchSignalEarly(&gLatch);
+                }
             }
+            bytes += (long)len * sizeof(int);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        gWorkerStats[worker].bytes += bytes;
+        gWorkerStats[worker].busyNs += (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+        if (gJobKind == JOB_REDUCE && !published) {
+            gWorkerAccs[worker] = acc;
+            SlotPublish(&gSlots[worker], 0);
+        }
+        NoteWorkerDone();
+
+        pthread_mutex_lock(&gPoolLock);
+        if (--gBusyWorkers == 0) {
+            pthread_cond_signal(&gPoolIdle);
         }
-        if (allDone) break; // Break out of loop if all threads are done
+        pthread_mutex_unlock(&gPoolLock);
     }
-    prod = ComputeTotalProduct();
-    printf("Threaded multiplication with parent continually checking on children completed in %ld ms. Product = %d\n", GetTime(), prod);
+    pthread_exit(0);
+}
 
-    // Multi-threaded with semaphores
-    InitSharedVars();
-    sem_init(&completed, 0, 0);
-    sem_init(&mutex, 0, 1);
-    SetTime();
-    
-    // Initialize threads with semaphores
-    for (i = 0; i < gThreadCount; i++) {
-        pthread_attr_init(&attr[i]);
-        pthread_create(&tid[i], &attr[i], ThFindProdWithSemaphore, (void*)indices[i]);
+// Next task for a worker: the head of its own deque, or else half of the
+// first other deque that still has work, -1 once every deque is empty
+int TakeTask(int worker) {
+    TaskDeque* own = &gDeques[worker];
+    int task = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) {
+        task = own->head++;
+    }
+    pthread_mutex_unlock(&own->lock);
+    if (task >= 0 || gJobKind == JOB_GENERATE) {
+        return task; // Generation is the first touch, it must stay on the worker's own share
     }
-    sem_wait(&completed);
-    prod = ComputeTotalProduct();
-    printf("Threaded multiplication with parent waiting on a semaphore completed in %ld ms. Prod = %d\n", GetTime(), prod);
 
-    // Cleanup
-    sem_destroy(&completed);
-    sem_destroy(&mutex);
-    return 0;
+    for (int i = 1; i < gThreadCount; i++) {
+        TaskDeque* victim = &gDeques[(worker + i) % gThreadCount];
+        int first = 0, end = 0;
+
+        // Take the upper half, rounded up, so a single task left can be stolen too
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            end = victim->tail;
+            first = end - (victim->tail - victim->head + 1) / 2;
+            victim->tail = first;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (first < end) {
+            pthread_mutex_lock(&own->lock);
+            own->head = first + 1;
+            own->tail = end;
+            pthread_mutex_unlock(&own->lock);
+            return first;
+        }
+    }
+    return -1;
+}
+
+// Zero-scan pre-pass: the workers compare every element with zero, which
+// only streams the array through, and stop together at the first zero found
+bool ParScanForZero() {
+    RunJob(JOB_ZERO_SCAN, WAIT_JOIN);
+    WaitForPool();
+    return atomic_load(&gCancel);
+}
+
+// Report a worker's end of job the way the current experiment expects.
+// Busy waiting needs nothing more: the parent polls the done flag of the
+// worker's result slot.
+void NoteWorkerDone() {
+    if (gWaitMode == WAIT_LATCH) {
+        LatchCountDown(&gLatch);
+    } else if (gWaitMode == WAIT_SEMAPHORE) {
+        // Protect access to gDoneThreadCount with mutex semaphore
+        sem_wait(&mutex);
+        gDoneThreadCount++;
+        if (gDoneThreadCount == gThreadCount) {
+            // All threads are done, so signal the parent
+            sem_post(&completed);
+        }
+        sem_post(&mutex);
+    }
+}
+
+// The kernel SelectProdKernel picked for this CPU
+int (*gProdKernel)(const int* data, int len) = ProdScalar;
+
+int ProdKernel(const int* data, int len) {
+    return gProdKernel(data, len);
+}
+
+// The zero-scan kernel SelectProdKernel picked for this CPU
+bool (*gZeroKernel)(const int* data, int len) = ZeroScalar;
+
+bool HasZero(const int* data, int len) {
+    return gZeroKernel(data, len);
+}
+
+// Runtime CPU dispatch, so one binary uses AVX-512 or AVX2 where the CPU has
+// them and the scalar loops everywhere else
+void SelectProdKernel(void) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        gProdKernel = ProdAvx512;
+        gZeroKernel = ZeroAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        gProdKernel = ProdAvx2;
+        gZeroKernel = ZeroAvx2;
+    }
+#endif
+}
+
+bool ZeroScalar(const int* data, int len) {
+    for (int i = 0; i < len; i++) {
+        if (data[i] == 0) return true;
+    }
+    return false;
+}
+
+// prodmod's block: ProdKernel is exact for NUM_LIMIT (the modulus
+// ReduceConfigure gives the operator) and stops at a zero like ProdModBlock
+void ProdModSimdBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    acc->v[0] = acc->v[0] * ProdKernel(data, (int)len) % op->param;
+}
+
+// prodmod's block for input whose elements can be anything: ProdKernel when
+// every element is in [0, NUM_LIMIT), as the SIMD kernels need, and the
+// generic block otherwise. The check is one compare per element.
+void ProdModCheckedBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    unsigned int over = 0;
+
+    for (long i = 0; i < len; i++) {
+        over |= (unsigned int)data[i] >= NUM_LIMIT;
+    }
+    if (over) {
+        ProdModBlock(op, acc, data, len);
+    } else {
+        ProdModSimdBlock(op, acc, data, len);
+    }
 }
 
-// Sequential FindProduct (no threads)
-int SqFindProd(int size) {
+// One element at a time, stopping at a zero
+int ProdScalar(const int* data, int len) {
     int prod = 1;
-    for (int i = 0; i < size; i++) {
-        prod *= gData[i];
+    for (int i = 0; i < len; i++) {
+        prod *= data[i];
         prod %= NUM_LIMIT;
-        if (gData[i] == 0) break; // Stop if zero is encountered
+        if (data[i] == 0) break; // Stop if zero is encountered
     }
     return prod;
 }
 
-// Thread FindProduct without semaphores
-void* ThFindProd(void *param) {
-    int threadNum = ((int*)param)[0];
-    int startIdx = ((int*)param)[1];
-    int endIdx = ((int*)param)[2];
+// NUM_LIMIT is prime and every element is below it, so the product is 0
+// exactly when some element is 0 and otherwise doesn't depend on the order of
+// the multiplications. That lets the SIMD kernels keep many independent
+// accumulators and still match ProdScalar bit for bit.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+// acc * vals mod NUM_LIMIT in each 64-bit lane, everything below 2^32 going in.
+// Barrett: q is the quotient or one less, so one conditional subtract finishes;
+// min_epu32 does it since r - NUM_LIMIT wraps to a huge value when r < NUM_LIMIT.
+__attribute__((target("avx2")))
+static inline __m256i MulModAvx2(__m256i acc, __m256i vals) {
+    const __m256i m = _mm256_set1_epi64x(BARRETT_M);
+    const __m256i p = _mm256_set1_epi64x(NUM_LIMIT);
+    __m256i x = _mm256_mul_epu32(acc, vals);
+    __m256i q = _mm256_srli_epi64(_mm256_mul_epu32(x, m), BARRETT_SHIFT);
+    __m256i r = _mm256_sub_epi64(x, _mm256_mul_epu32(q, p));
+    return _mm256_min_epu32(r, _mm256_sub_epi32(r, p));
+}
+
+// 4 vectors of 4 lanes: 16 independent accumulators, so the multiply latency
+// of one chain is hidden behind the others
+__attribute__((target("avx2")))
+int ProdAvx2(const int* data, int len) {
+    __m256i acc[4];
+    uint64_t lanes[4];
+    int i = 0;
     int prod = 1;
 
-    // Compute the product for the assigned division
-    for (int i = startIdx; i <= endIdx; i++) {
-        prod *= gData[i];
-        prod %= NUM_LIMIT;
-        if (gData[i] == 0) {
-            gThreadProd[threadNum] = 0;
-            gThreadDone[threadNum] = true; // Mark thread as done
-            pthread_exit(0); // Exit if zero is found
+    for (int a = 0; a < 4; a++) {
+        acc[a] = _mm256_set1_epi64x(1);
+    }
+    while (i + 16 <= len) {
+        int blockEnd = i + ZERO_CHECK_BLOCK < len ? i + ZERO_CHECK_BLOCK : len;
+        __m256i zeros = _mm256_setzero_si256();
+
+        for (; i + 16 <= blockEnd; i += 16) {
+            for (int a = 0; a < 4; a++) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(data + i + 4 * a));
+                zeros = _mm256_or_si256(zeros, _mm256_castsi128_si256(_mm_cmpeq_epi32(v, _mm_setzero_si128())));
+                acc[a] = MulModAvx2(acc[a], _mm256_cvtepu32_epi64(v));
+            }
+        }
+        if (!_mm256_testz_si256(zeros, zeros)) {
+            return 0; // Stop if zero is encountered
         }
     }
 
-    gThreadProd[threadNum] = prod;
-    gThreadDone[threadNum] = true; // Mark thread as done
+    for (int a = 0; a < 4; a++) {
+        _mm256_storeu_si256((__m256i*)lanes, acc[a]);
+        for (int l = 0; l < 4; l++) {
+            prod = prod * (int)lanes[l] % NUM_LIMIT;
+        }
+    }
+    // Fewer than 16 left
+    int tail = ProdScalar(data + i, len - i);
+    return prod * tail % NUM_LIMIT;
+}
 
-    pthread_exit(0);
+// Same as MulModAvx2 on 8 lanes
+__attribute__((target("avx512f")))
+static inline __m512i MulModAvx512(__m512i acc, __m512i vals) {
+    const __m512i m = _mm512_set1_epi64(BARRETT_M);
+    const __m512i p = _mm512_set1_epi64(NUM_LIMIT);
+    __m512i x = _mm512_mul_epu32(acc, vals);
+    __m512i q = _mm512_srli_epi64(_mm512_mul_epu32(x, m), BARRETT_SHIFT);
+    __m512i r = _mm512_sub_epi64(x, _mm512_mul_epu32(q, p));
+    return _mm512_min_epu32(r, _mm512_sub_epi32(r, p));
 }
 
-// Thread FindProduct with semaphores
-void* ThFindProdWithSemaphore(void *param) {
-    int threadNum = ((int*)param)[0];
-    int startIdx = ((int*)param)[1];
-    int endIdx = ((int*)param)[2];
+// 4 vectors of 8 lanes: 32 independent accumulators
+__attribute__((target("avx512f")))
+int ProdAvx512(const int* data, int len) {
+    __m512i acc[4];
+    uint64_t lanes[8];
+    int i = 0;
     int prod = 1;
 
-    // Compute the product for the assigned division
-    for (int i = startIdx; i <= endIdx; i++) {
-        prod *= gData[i];
-        prod %= NUM_LIMIT;
-        if (gData[i] == 0) { // If a zero is found, notify parent and exit
-            gThreadProd[threadNum] = 0; 
-            sem_post(&completed); // Notify parent immediately
-            pthread_exit(0); // Exit the thread
-        }
+    for (int a = 0; a < 4; a++) {
+        acc[a] = _mm512_set1_epi64(1);
     }
+    while (i + 32 <= len) {
+        int blockEnd = i + ZERO_CHECK_BLOCK < len ? i + ZERO_CHECK_BLOCK : len;
+        __mmask16 zeros = 0;
 
-    // Store the product for this thread
-    gThreadProd[threadNum] = prod;
+        for (; i + 32 <= blockEnd; i += 32) {
+            __m512i v16a = _mm512_loadu_si512((const void*)(data + i));
+            __m512i v16b = _mm512_loadu_si512((const void*)(data + i + 16));
+            zeros |= _mm512_cmpeq_epi32_mask(v16a, _mm512_setzero_si512());
+            zeros |= _mm512_cmpeq_epi32_mask(v16b, _mm512_setzero_si512());
+            acc[0] = MulModAvx512(acc[0], _mm512_cvtepu32_epi64(_mm512_castsi512_si256(v16a)));
+            acc[1] = MulModAvx512(acc[1], _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(v16a, 1)));
+            acc[2] = MulModAvx512(acc[2], _mm512_cvtepu32_epi64(_mm512_castsi512_si256(v16b)));
+            acc[3] = MulModAvx512(acc[3], _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(v16b, 1)));
+        }
+        if (zeros != 0) {
+            return 0; // Stop if zero is encountered
+        }
+    }
 
-    // Protect access to gDoneThreadCount with mutex semaphore
-    sem_wait(&mutex);
-    gDoneThreadCount++;
-    if (gDoneThreadCount == gThreadCount) {
-        // All threads are done, so signal the parent
-        sem_post(&completed);
+    for (int a = 0; a < 4; a++) {
+        _mm512_storeu_si512((void*)lanes, acc[a]);
+        for (int l = 0; l < 8; l++) {
+            prod = prod * (int)lanes[l] % NUM_LIMIT;
+        }
     }
-    sem_post(&mutex);
+    // Fewer than 32 left
+    int tail = ProdScalar(data + i, len - i);
+    return prod * tail % NUM_LIMIT;
+}
 
-    pthread_exit(0);
+// 32 elements per step, OR-ing the compare results and testing once per step
+__attribute__((target("avx2")))
+bool ZeroAvx2(const int* data, int len) {
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i zeros = _mm256_setzero_si256();
+        for (int v = 0; v < 4; v++) {
+            __m256i vals = _mm256_loadu_si256((const __m256i*)(data + i + 8 * v));
+            zeros = _mm256_or_si256(zeros, _mm256_cmpeq_epi32(vals, _mm256_setzero_si256()));
+        }
+        if (!_mm256_testz_si256(zeros, zeros)) {
+            return true;
+        }
+    }
+    return ZeroScalar(data + i, len - i);
 }
 
+// 64 elements per step
+__attribute__((target("avx512f")))
+bool ZeroAvx512(const int* data, int len) {
+    int i = 0;
 
-// Multiply the division products to compute the total modular product
-int ComputeTotalProduct() {
-    int i, prod = 1;
-    for (i = 0; i < gThreadCount; i++) {
-        if (gThreadProd[i] == 0) {
-            return 0; // If any thread found a zero, the total product is zero
+    for (; i + 64 <= len; i += 64) {
+        __mmask16 zeros = 0;
+        for (int v = 0; v < 4; v++) {
+            zeros |= _mm512_cmpeq_epi32_mask(_mm512_loadu_si512((const void*)(data + i + 16 * v)), _mm512_setzero_si512());
+        }
+        if (zeros != 0) {
+            return true;
         }
-        prod *= gThreadProd[i];
-        prod %= NUM_LIMIT;
     }
-    return prod;
+    return ZeroScalar(data + i, len - i);
+}
+#else
+// No x86 SIMD on this target; SelectProdKernel never picks these
+int ProdAvx2(const int* data, int len) {
+    return ProdScalar(data, len);
 }
 
+int ProdAvx512(const int* data, int len) {
+    return ProdScalar(data, len);
+}
+
+bool ZeroAvx2(const int* data, int len) {
+    return ZeroScalar(data, len);
+}
+
+bool ZeroAvx512(const int* data, int len) {
+    return ZeroScalar(data, len);
+}
+#endif
+
 // Initialize shared variables
 void InitSharedVars() {
-    int i;
-    for (i = 0; i < gThreadCount; i++) {
-        gThreadDone[i] = false;
-        gThreadProd[i] = 1;
-    }
+    SlotsReset(gSlots, gThreadCount, 1);
+    LatchInit(&gLatch, gThreadCount);
     gDoneThreadCount = 0;
 }
 
-// Generate the input array with random numbers, place zero if required
+// Generate the input array with random numbers, place zero if required.
+// Each worker writes its own starting share, which is also the first touch
+// of those pages: the kernel places them on the worker's NUMA node, and the
+// product jobs deal out the same shares, so most reads stay local.
 void GenerateInput(int size, int indexForZero) {
-    srand(RANDOM_SEED);
-    for (int i = 0; i < size; i++) {
-        gData[i] = GetRand(1, MAX_RANDOM_NUMBER);
+    RunJob(JOB_GENERATE, WAIT_JOIN);
+    WaitForPool();
+    if (gCheckGen) {
+        CheckGeneration();
     }
     if (indexForZero >= 0 && indexForZero < size) {
         gData[indexForZero] = 0;
     }
 }
 
-// Calculate the right indices to divide the array into thread count equal divisions
-void CalculateIndices(int arraySize, int thrdCnt, int indices[MAX_THREADS][3]) {
-    int chunkSize = arraySize / thrdCnt;
-    for (int i = 0; i < thrdCnt; i++) {
-        indices[i][0] = i;
-        indices[i][1] = i * chunkSize;
-        indices[i][2] = (i == thrdCnt - 1) ? arraySize - 1 : (i + 1) * chunkSize - 1;
+// Elements [first, first + len) of the input. Whole groups go straight to
+// out, a group cut by either end of the range goes through tmp.
+void GenerateRange(int* out, long first, int len) {
+    int tmp[GEN_GROUP];
+    long i = first, end = first + len;
+
+    while (i < end) {
+        long group = i / GEN_GROUP;
+        int off = (int)(i - group * GEN_GROUP);
+        int n = end - i < GEN_GROUP - off ? (int)(end - i) : GEN_GROUP - off;
+
+        if (n == GEN_GROUP) {
+            GenerateGroup(group, out + (i - first));
+        } else {
+            GenerateGroup(group, tmp);
+            memcpy(out + (i - first), tmp + off, n * sizeof(int));
+        }
+        i += n;
     }
 }
 
-// Get a random number in the range [x, y]
-int GetRand(int x, int y) {
-    int r = rand();
-    r = x + r % (y - x + 1);
-    return r;
+// Philox4x32-10 on counters group * PHILOX_LANES + l, key (RANDOM_SEED, 0).
+// Word j of counter l becomes element group * GEN_GROUP + j * PHILOX_LANES + l,
+// so each word vector is stored as is. Values are mapped to
+// [1, MAX_RANDOM_NUMBER] from their top 20 bits by a multiply and shift,
+// which stays in 32 bits, instead of a modulo.
+// The vector code is compiled for AVX-512, AVX2 and baseline, and the loader
+// picks one for this CPU (GCC function multiversioning).
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__linux__)
+__attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+void GenerateGroup(long group, int* out) {
+    const PhiloxVec lane = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, zero = { 0 };
+    uint64_t ctr = (uint64_t)group * PHILOX_LANES; // Low bits are 0, so adding the lane never carries
+    PhiloxVec x[4] = { lane + (uint32_t)ctr, zero + (uint32_t)(ctr >> 32), zero, zero };
+    PhiloxVec k0 = zero + RANDOM_SEED, k1 = zero;
+
+    for (int r = 0; r < PHILOX_ROUNDS; r++) {
+        PhiloxWide p0 = __builtin_convertvector(x[0], PhiloxWide) * PHILOX_M0;
+        PhiloxWide p1 = __builtin_convertvector(x[2], PhiloxWide) * PHILOX_M1;
+        PhiloxVec y0 = __builtin_convertvector(p1 >> 32, PhiloxVec) ^ x[1] ^ k0;
+        PhiloxVec y2 = __builtin_convertvector(p0 >> 32, PhiloxVec) ^ x[3] ^ k1;
+
+        x[1] = __builtin_convertvector(p1, PhiloxVec);
+        x[3] = __builtin_convertvector(p0, PhiloxVec);
+        x[0] = y0;
+        x[2] = y2;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    for (int j = 0; j < 4; j++) {
+        PhiloxVec vals = ((x[j] >> 12) * MAX_RANDOM_NUMBER >> 20) + 1;
+        memcpy(out + j * PHILOX_LANES, &vals, sizeof(vals));
+    }
 }
 
-// Timing functions
-long GetMilliSecondTime(struct timeb timeBuf) {
-    long mliScndTime;
-    mliScndTime = timeBuf.time;
-    mliScndTime *= 1000;
-    mliScndTime += timeBuf.millitm;
-    return mliScndTime;
+uint64_t HashInts(uint64_t hash, const int* data, long len) {
+    for (long i = 0; i < len; i++) {
+        hash = (hash ^ (uint32_t)data[i]) * FNV_PRIME;
+    }
+    return hash;
 }
 
-long GetCurrentTime(void) {
-    long crntTime = 0;
-    struct timeb timeBuf;
-    ftime(&timeBuf);
-    crntTime = GetMilliSecondTime(timeBuf);
-    return crntTime;
+// Make the whole input again on this thread, split the way other thread
+// counts would split it, and compare hashes with gData. The splits fall on
+// element rather than task boundaries, so shares start and end mid-group too.
+void CheckGeneration() {
+    int counts[] = { 1, 2, 3, 7, gThreadCount + 1 };
+    int buf[TASK_SIZE];
+    uint64_t want = HashInts(FNV_OFFSET, gData, gArraySize);
+
+    for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+        int threads = counts[c];
+        uint64_t hash = FNV_OFFSET;
+
+        for (int w = 0; w < threads; w++) {
+            long first = (long)gArraySize * w / threads;
+            long end = (long)gArraySize * (w + 1) / threads;
+            for (long i = first; i < end; i += TASK_SIZE) {
+                int len = end - i < TASK_SIZE ? (int)(end - i) : TASK_SIZE;
+                GenerateRange(buf, i, len);
+                hash = HashInts(hash, buf, len);
+            }
+        }
+        if (hash != want) {
+            fprintf(stderr, "Generation check failed: %d threads give %016llx, %d give %016llx\n",
+                    threads, (unsigned long long)hash, gThreadCount, (unsigned long long)want);
+            exit(-1);
+        }
+    }
+    printf("Generation check: the %d-thread input matches 1, 2, 3, 7 and %d threads (hash %016llx)\n",
+           gThreadCount, gThreadCount + 1, (unsigned long long)want);
 }
 
+// Reduce the first count elements of a file of native ints (all of them if
+// count is 0) a window at a time. The pool reduces one window while the parent
+// reads the next one in; a window is unmapped and dropped from the page cache
+// once it is reduced, so memory use stays around two windows however big the
+// file is.
+void RunStreamed(const char* path, long count) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    ReduceAcc total, part;
+    char result[REDUCE_MAX_WIDTH * 24];
+    double raw = 0;
+    long reduced = 0; // Elements read so far
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        exit(-1);
+    }
+    long elems = st.st_size / (long)sizeof(int); // A partial int at the end is ignored
+    if (count > elems) {
+        fprintf(stderr, "%s holds only %ld elements\n", path, elems);
+        exit(-1);
+    }
+    if (count > 0) {
+        elems = count;
+    }
+    if (gRawRead) {
+        raw = MeasureRawRead(fd, elems * (long)sizeof(int));
+        printf("Plain read of %s: %.2f GB/s\n", path, raw);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); // Start cold, whatever an earlier run left cached
+
+    ReduceInit(gOp, &total);
+    SetTime();
+    int* next = elems > 0 ? MapWindow(fd, 0, elems) : NULL;
+    long first;
+    for (first = 0; first < elems && !ReduceAbsorbed(gOp, &total); first += STREAM_WINDOW) {
+        int* cur = next;
+        int len = elems - first < STREAM_WINDOW ? (int)(elems - first) : STREAM_WINDOW;
+
+        next = NULL;
+        gData = cur;
+        gArraySize = len;
+        gTaskCount = (len + TASK_SIZE - 1) / TASK_SIZE;
+        InitSharedVars();
+        if (gZeroScan && ParScanForZero()) {
+            ReduceInit(gOp, &part);
+            part.v[0] = 0;
+        } else {
+            RunJob(JOB_REDUCE, WAIT_JOIN);
+            next = first + len < elems ? MapWindow(fd, first + len, elems) : NULL; // While the pool works
+            WaitForPool();
+            ReduceMerge(gOp, gWorkerAccs, gSlots, gThreadCount, &part);
+        }
+        gOp->combine(gOp, &total, &part);
+        reduced += len;
+        munmap(cur, (size_t)len * sizeof(int));
+        posix_fadvise(fd, first * (long)sizeof(int), (long)len * sizeof(int), POSIX_FADV_DONTNEED);
+    }
+    if (next != NULL) { // Stopped early at a zero
+        long left = elems - first;
+        munmap(next, (size_t)(left < STREAM_WINDOW ? left : STREAM_WINDOW) * sizeof(int));
+    }
+    long ms = GetTime();
+    double rate = (double)reduced * sizeof(int) / (ms > 0 ? ms : 1) / 1e6;
+
+    ReduceFormat(gOp, &total, result, sizeof(result));
+    printf("Streamed %s of %ld elements completed in %ld ms, %.2f GB/s", gOp->task, elems, ms, rate);
+    if (raw > 0) {
+        printf(" (%.0f%% of a plain read)", 100 * rate / raw);
+    }
+    if (reduced < elems) {
+        printf(", stopped at a zero after %ld elements", reduced);
+    }
+    printf(". %s = %s\n", gOp->label, result);
+    gData = NULL;
+    close(fd);
+}
+
+// Map the window starting at element first (a multiple of STREAM_WINDOW, so
+// the offset is page aligned) with its pages already read in and mapped, so
+// the workers never fault on it. Readahead alone left them taking a fault
+// every few pages, and the streamed sum ran at half the speed.
+int* MapWindow(int fd, long first, long elems) {
+    long len = elems - first < STREAM_WINDOW ? elems - first : STREAM_WINDOW;
+    int flags = MAP_SHARED;
+
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    int* window = mmap(NULL, (size_t)len * sizeof(int), PROT_READ, flags, fd, first * (long)sizeof(int));
+    if (window == MAP_FAILED) {
+        fprintf(stderr, "Failed to map the input file at element %ld\n", first);
+        exit(-1);
+    }
+#ifndef MAP_POPULATE
+    madvise(window, (size_t)len * sizeof(int), MADV_WILLNEED);
+#endif
+    return window;
+}
+
+// Read the file's first bytes with nothing else going on, from a cold page
+// cache, for the bandwidth the device gives a plain sequential reader
+double MeasureRawRead(int fd, long bytes) {
+    size_t bufSize = STREAM_WINDOW * sizeof(int);
+    char* buf = malloc(bufSize);
+    long done = 0;
+
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate the read buffer\n");
+        exit(-1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    SetTime();
+    while (done < bytes) {
+        ssize_t n = pread(fd, buf, bytes - done < (long)bufSize ? (size_t)(bytes - done) : bufSize, done);
+        if (n <= 0) {
+            fprintf(stderr, "Failed to read the input file\n");
+            exit(-1);
+        }
+        done += n;
+    }
+    long ms = GetTime();
+    free(buf);
+    return (double)bytes / (ms > 0 ? ms : 1) / 1e6;
+}
+
+// Build the product index over gData: the pool builds each task's leaves and
+// the subtree above them, then the few levels above the tasks are combined
+// here. Nodes are 16 bits, so the levels near the root share cache lines.
+void IndexBuild() {
+    int blocks;
+
+    gIndexLeaves = INDEX_BLOCK_LEAVES;
+    while (gIndexLeaves < (gArraySize + INDEX_LEAF - 1) / INDEX_LEAF) {
+        gIndexLeaves *= 2;
+    }
+    gIndex = malloc(2 * (size_t)gIndexLeaves * sizeof(uint16_t));
+    if (gIndex == NULL) {
+        fprintf(stderr, "Failed to allocate the product index\n");
+        exit(-1);
+    }
+    RunJob(JOB_INDEX, WAIT_JOIN);
+    WaitForPool();
+
+    blocks = gIndexLeaves / INDEX_BLOCK_LEAVES;
+    for (int b = gTaskCount; b < blocks; b++) {
+        gIndex[blocks + b] = 1; // Subtrees past the end of the array, never looked into
+    }
+    for (int i = blocks - 1; i >= 1; i--) {
+        gIndex[i] = gIndex[2 * i] * gIndex[2 * i + 1] % NUM_LIMIT;
+    }
+}
+
+// A task's INDEX_BLOCK_LEAVES leaves are an aligned whole subtree, so the
+// worker can build it level by level without meeting another task's nodes
+void IndexBuildBlock(int task) {
+    int first = gIndexLeaves + task * INDEX_BLOCK_LEAVES;
+
+    for (int l = 0; l < INDEX_BLOCK_LEAVES; l++) {
+        gIndex[first + l] = IndexLeafProd(task * INDEX_BLOCK_LEAVES + l);
+    }
+    for (int cnt = INDEX_BLOCK_LEAVES / 2; cnt >= 1; cnt /= 2) {
+        first /= 2;
+        for (int i = first; i < first + cnt; i++) {
+            gIndex[i] = gIndex[2 * i] * gIndex[2 * i + 1] % NUM_LIMIT;
+        }
+    }
+}
+
+// Product of one leaf's elements, 1 for a leaf past the end of the array
+int IndexLeafProd(int leaf) {
+    long start = (long)leaf * INDEX_LEAF;
+
+    if (start >= gArraySize) {
+        return 1;
+    }
+    return ProdKernel(&gData[start], gArraySize - start < INDEX_LEAF ? (int)(gArraySize - start) : INDEX_LEAF);
+}
+
+// Every node is recomputed from its children, never by dividing the old
+// value out, so a zero written or overwritten is exact
+void IndexUpdate(int i, int value) {
+    int node = gIndexLeaves + i / INDEX_LEAF;
+
+    gData[i] = value;
+    gIndex[node] = IndexLeafProd(node - gIndexLeaves);
+    for (node /= 2; node >= 1; node /= 2) {
+        gIndex[node] = gIndex[2 * node] * gIndex[2 * node + 1] % NUM_LIMIT;
+    }
+}
+
+static int CompareInts(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Write every element, then recompute each touched leaf once and go up a
+// level at a time. The parents of a sorted list of nodes are sorted too, so
+// shared ancestors are adjacent and are recomputed once.
+void IndexUpdateBatch(int* idx, const int* values, int cnt) {
+    int m = 0;
+
+    if (cnt == 0) {
+        return;
+    }
+    for (int k = 0; k < cnt; k++) {
+        gData[idx[k]] = values[k];
+    }
+    qsort(idx, cnt, sizeof(int), CompareInts);
+    for (int k = 0; k < cnt; k++) { // idx becomes the list of touched leaves
+        int leaf = idx[k] / INDEX_LEAF;
+        if (m == 0 || idx[m - 1] != gIndexLeaves + leaf) {
+            idx[m++] = gIndexLeaves + leaf;
+            gIndex[gIndexLeaves + leaf] = IndexLeafProd(leaf);
+        }
+    }
+    while (idx[0] > 1) {
+        int parents = 0;
+        for (int k = 0; k < m; k++) {
+            int node = idx[k] / 2;
+            if (parents == 0 || idx[parents - 1] != node) {
+                idx[parents++] = node;
+                gIndex[node] = gIndex[2 * node] * gIndex[2 * node + 1] % NUM_LIMIT;
+            }
+        }
+        m = parents;
+    }
+}
+
+// The partial leaves at either end are multiplied directly, the whole leaves
+// between them bottom-up through the tree, stopping at a zero
+int IndexQuery(int l, int r) {
+    int lLeaf = l / INDEX_LEAF, rLeaf = r / INDEX_LEAF;
+
+    if (rLeaf - lLeaf < 2) {
+        return ProdKernel(&gData[l], r - l + 1); // Two leaves at most, as cheap to scan
+    }
+    int prod = ProdKernel(&gData[l], (lLeaf + 1) * INDEX_LEAF - l) *
+               ProdKernel(&gData[rLeaf * INDEX_LEAF], r - rLeaf * INDEX_LEAF + 1) % NUM_LIMIT;
+    for (int lo = gIndexLeaves + lLeaf + 1, hi = gIndexLeaves + rLeaf; lo < hi && prod != 0; lo /= 2, hi /= 2) {
+        if (lo & 1) prod = prod * gIndex[lo++] % NUM_LIMIT;
+        if (hi & 1) prod = prod * gIndex[--hi] % NUM_LIMIT;
+    }
+    return prod;
+}
+
+// Next number of a xorshift64 sequence, for the benchmark's operations
+static uint64_t NextRandom(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Index benchmark (-i): build the index on the pool, then for several numbers
+// of updates per query, play the same rounds of random updates and one random
+// range query three ways: plain writes and a rescan of the range with the
+// SIMD kernel, the index with point updates, and the index with the round's
+// updates batched. Every answer is checked against the rescan. One update in
+// 256 writes a zero, or puts back the zero written last, so queries cross
+// zeros appearing and going away.
+void RunIndexBenchmark(int queries) {
+    static const int perQuery[] = { 1, 10, 100, 1000, 10000 };
+    int cnt = (int)(sizeof(perQuery) / sizeof(perQuery[0]));
+
+    SetTime();
+    IndexBuild();
+    printf("Index of %d leaves of %d elements built in %ld ms\n", gIndexLeaves, INDEX_LEAF, GetTime());
+
+    for (int c = 0; c < cnt; c++) {
+        int updates = perQuery[c];
+        int* idx = malloc(updates * sizeof(int));
+        int* values = malloc(updates * sizeof(int));
+        int* batch = malloc(updates * sizeof(int));
+        uint64_t rng = RANDOM_SEED + c;
+        long zeroAt = -1, rescanNs = 0, pointNs = 0, batchNs = 0;
+
+        if (idx == NULL || values == NULL || batch == NULL) {
+            fprintf(stderr, "Failed to allocate the benchmark updates\n");
+            exit(-1);
+        }
+        for (int q = 0; q < queries; q++) {
+            for (int u = 0; u < updates; u++) {
+                idx[u] = (int)(NextRandom(&rng) % gArraySize);
+                values[u] = 1 + (int)(NextRandom(&rng) % MAX_RANDOM_NUMBER);
+                if (NextRandom(&rng) % 256 == 0) {
+                    if (zeroAt < 0) {
+                        values[u] = 0;
+                        zeroAt = idx[u];
+                    } else {
+                        idx[u] = (int)zeroAt;
+                        zeroAt = -1;
+                    }
+                }
+            }
+            int l = (int)(NextRandom(&rng) % gArraySize);
+            int r = (int)(NextRandom(&rng) % gArraySize);
+            if (l > r) {
+                int t = l;
+                l = r;
+                r = t;
+            }
+
+            long start = GetNanoTime();
+            for (int u = 0; u < updates; u++) {
+                gData[idx[u]] = values[u];
+            }
+            int expected = ProdKernel(&gData[l], r - l + 1);
+            rescanNs += GetNanoTime() - start;
+
+            start = GetNanoTime();
+            for (int u = 0; u < updates; u++) {
+                IndexUpdate(idx[u], values[u]);
+            }
+            int point = IndexQuery(l, r);
+            pointNs += GetNanoTime() - start;
+
+            memcpy(batch, idx, updates * sizeof(int));
+            start = GetNanoTime();
+            IndexUpdateBatch(batch, values, updates);
+            int batched = IndexQuery(l, r);
+            batchNs += GetNanoTime() - start;
+
+            if (point != expected || batched != expected) {
+                fprintf(stderr, "Index query [%d, %d] gave %d and %d, a rescan %d\n", l, r, point, batched, expected);
+                exit(-1);
+            }
+        }
+        printf("Index, %d updates per query: rescan %.1f us, point updates %.1f us, batched updates %.1f us per round"
+               " (%.1fx the speed of a rescan)\n", updates, rescanNs / 1e3 / queries, pointNs / 1e3 / queries,
+               batchNs / 1e3 / queries, (double)rescanNs / (batchNs < pointNs ? batchNs : pointNs));
+        free(idx);
+        free(values);
+        free(batch);
+    }
+    free(gIndex);
+}
+
+// Timing functions
 void SetTime(void) {
-    gRefTime = GetCurrentTime();
+    gRefTime = GetNanoTime();
 }
 
+// Milliseconds since SetTime
 long GetTime(void) {
-    long crntTime = GetCurrentTime();
-    return (crntTime - gRefTime);
+    return (GetNanoTime() - gRefTime) / 1000000;
 }
@@ -3,46 +3,94 @@ Ryan Sario
 Section: 01
 OS: macOS
 */
-
+#define _GNU_SOURCE // CPU affinity on Linux
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <sys/shm.h>
-#include <sys/timeb.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <semaphore.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <string.h>
+#ifdef __linux__
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#endif
+#include "completion.h"
+#include "reduce.h"
+#include "bench.h"
 
-#define MAX_SIZE 100000000
 #define MAX_PROCESSES 16
 #define RANDOM_SEED 7649
 #define MAX_RANDOM_NUMBER 3000
 #define NUM_LIMIT 9973
-
-// Global variables for shared memory
+#define PAGE_BYTES 4096 // The array starts on a page of its own
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Everything the parent and the worker processes share besides the array.
+// It heads the one MAP_SHARED | MAP_ANONYMOUS mapping, and the array follows
+// on the next page. The pool control mirrors MTFindProd's thread pool, with
+// the mutex and condition variables made process-shared.
+typedef struct {
+    ResultSlot slots[MAX_PROCESSES]; // Whether each process is done, one cache line each
+    ReduceAcc accs[MAX_PROCESSES]; // The accumulator of each process division
+    Latch latch; // Latch for the latch experiment
+    sem_t completed;
+    sem_t mutex;
+    int doneProcessCount;
+    pthread_mutex_t poolLock;
+    pthread_cond_t poolWake; // A job was posted or the pool is stopping
+    pthread_cond_t poolIdle; // The last busy worker finished its job
+    int jobGen; // Bumped for every job, so workers can tell a new one from a spurious wakeup
+    int busyWorkers; // Workers still on the current job
+    bool poolStop; // Set once to make the workers exit
+    WaitMode waitMode; // How the current job reports back to the parent
+    atomic_bool cancel; // A process found a zero: the others stop at their next block
+} SharedState;
+
+// Global variables for shared memory, all pointing into the one mapping
+SharedState *gShared; // The head of the mapping
+size_t gSharedBytes; // Size of the mapping
+bool gHugePages; // Back the mapping with huge pages (-H)
 int *gData; // The array that will hold the data (shared memory)
-int *gProcessProd; // Shared memory for the product of each process division
+ReduceAcc *gProcessAccs; // Shared memory for the accumulator of each process division
+ResultSlot *gProcessSlots; // Shared memory for whether each process is done, one cache line each
+Latch *gLatch; // Shared memory latch for the latch experiment
 int *gDoneProcessCount; // Shared memory for counting done processes
 int processCount; // Global variable for number of processes
-long gRefTime; // Global variable for timing reference
+int gArraySize; // Number of elements in use
+pid_t gWorkerPids[MAX_PROCESSES]; // The pre-forked worker processes
+long gRefTime; // Global variable for timing reference, in ns
+ReduceOp *gOp; // Operator the array is reduced with (-o), the modular product by default
 
 // Semaphores in shared memory
 sem_t *completed; // To notify parent that all processes have completed or one of them found a zero
 sem_t *mutex; // Binary semaphore to protect access to shared data like gDoneProcessCount
 
 // Function declarations
-int SqFindProd(int size); // Sequential FindProduct (no processes)
-void ProcessFindProd(int processNum, int startIdx, int endIdx); // Function for processes to compute the product
-int ComputeTotalProduct(); // Multiply the division products to compute the total modular product
-void InitSharedMemory(int size); // Initialize shared memory variables
+void ProcessReduce(int processNum, long first, long end, WaitMode mode); // Function for processes to reduce their division
+void ProcReduce(WaitMode mode, ReduceAcc* total); // Post a job to the worker processes and wait for them the given way
+long TimedProcReduce(WaitMode mode, ReduceAcc* total); // One process-based reduction, timed in ns
+void RunBenchmark(int trials, int arraySize, int onlyMode); // Benchmark mode: summaries of repeated runs of every variant
+void ResetSharedState(); // Reset the result slots, counters, semaphores and latch between experiments
+void InitSharedMemory(int size); // Map the shared region and initialize everything in it
+void FreeSharedMemory(); // Destroy the semaphores and pool control and unmap the region
+void StartPool(); // Fork the worker processes, outside the timed sections
+void PinWorker(int worker); // Pin a worker process to one CPU
+void WorkerMain(int worker); // Worker process: runs one job per generation, never returns
+void RunJob(WaitMode mode); // Post a job to the worker processes and wake them
+void WaitForPool(); // Wait until every worker process is done with the current job
+void StopPool(); // Make the worker processes exit and reap them
 void GenerateInput(int size, int indexForZero); // Generate the input array
-void CalculateIndices(int arraySize, int processCnt, int indices[MAX_PROCESSES][3]); // Calculate the indices to divide the array into equal divisions
+void ProdModConstBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len); // prodmod's block for NUM_LIMIT
 int GetRand(int min, int max); // Get a random number between min and max
 
 // Timing functions
-long GetMilliSecondTime(struct timeb timeBuf);
-long GetCurrentTime(void);
 void SetTime(void);
 long GetTime(void);
 
@@ -50,19 +98,46 @@ long GetTime(void);
 
 
 int main(int argc, char *argv[]) {
-    int indices[MAX_PROCESSES][3];
-    int i, indexForZero, arraySize, prod;
-    pid_t pid[MAX_PROCESSES];
-
-    // Code for parsing and checking command-line arguments
-    if (argc != 4) {
+    int indexForZero, arraySize;
+    int onlyMode = -1;
+    int benchTrials = 0;
+    ReduceAcc acc;
+    char result[REDUCE_MAX_WIDTH * 24];
+
+    // Code for parsing and checking command-line arguments; optional trailing
+    // flags: -w join|busy|sem|latch runs only that process experiment,
+    // -o prodmod|sum|min|max|xor|hist picks what the array is reduced with,
+    // -b trials benchmarks every variant over that many runs instead,
+    // -H asks for huge pages
+    if (argc < 4) {
         fprintf(stderr, "Invalid number of arguments!\n");
         exit(-1);
     }
-    if ((arraySize = atoi(argv[1])) <= 0 || arraySize > MAX_SIZE) {
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc && (onlyMode = ParseWaitMode(argv[i + 1])) >= 0) {
+            i++;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && (gOp = ReduceFindOp(argv[i + 1])) != NULL) {
+            i++;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc && (benchTrials = atoi(argv[i + 1])) > 0) {
+            i++;
+        } else if (strcmp(argv[i], "-H") == 0) {
+            gHugePages = true;
+        } else {
+            fprintf(stderr, "Invalid option %s\n", argv[i]);
+            exit(-1);
+        }
+    }
+    if (gOp == NULL) {
+        gOp = ReduceFindOp("prodmod");
+    }
+    ReduceConfigure(NUM_LIMIT, MAX_RANDOM_NUMBER);
+    ReduceFindOp("prodmod")->block = ProdModConstBlock;
+    long size = strtol(argv[1], NULL, 10);
+    if (size <= 0 || size > INT_MAX) {
         fprintf(stderr, "Invalid Array Size\n");
         exit(-1);
     }
+    arraySize = (int)size;
     processCount = atoi(argv[2]);
     if (processCount > MAX_PROCESSES || processCount <= 0) {
         fprintf(stderr, "Invalid Process Count\n");
@@ -74,155 +149,368 @@ int main(int argc, char *argv[]) {
         exit(-1);
     }
 
-    // Initialize shared memory and generate input data
+    // Initialize shared memory, generate input data and fork the workers
     InitSharedMemory(arraySize);
     GenerateInput(arraySize, indexForZero);
-    CalculateIndices(arraySize, processCount, indices);
-
-    // Sequential multiplication
-    SetTime();
-    prod = SqFindProd(arraySize);
-    printf("Sequential multiplication completed in %ld ms. Product = %d\n", GetTime(), prod);
-
-    // Process-based multiplication with parent waiting for all child processes
-    SetTime();
-    for (i = 0; i < processCount; i++) {
-        pid[i] = fork();
-        if (pid[i] == 0) { // Child process
-            ProcessFindProd(i, indices[i][1], indices[i][2]);
-            exit(0);
+    gArraySize = arraySize;
+    StartPool();
+
+    if (benchTrials > 0) {
+        RunBenchmark(benchTrials, arraySize, onlyMode);
+    } else {
+        // Sequential reduction
+        SetTime();
+        ReduceInit(gOp, &acc);
+        ReduceRange(gOp, &acc, gData, arraySize);
+        long ms = GetTime();
+        ReduceFormat(gOp, &acc, result, sizeof(result));
+        printf("Sequential %s completed in %ld ms. %s = %s\n", gOp->task, ms, gOp->label, result);
+
+        // Process-based reduction, once for each way the parent can wait
+        for (int mode = 0; mode < WAIT_MODES; mode++) {
+            if (onlyMode >= 0 && onlyMode != mode) {
+                continue;
+            }
+            long ns = TimedProcReduce(mode, &acc);
+            ReduceFormat(gOp, &acc, result, sizeof(result));
+            printf("Process-based %s with parent %s completed in %ld ms. %s = %s\n", gOp->task, gWaitModeHow[mode],
+                   ns / 1000000, gOp->label, result);
         }
     }
 
-    // Parent process waits for all child processes to complete
-    for (i = 0; i < processCount; i++) {
-        wait(NULL);
-    }
-    prod = ComputeTotalProduct();
-    printf("Process-based multiplication with parent waiting for all children completed in %ld ms. Product = %d\n", GetTime(), prod);
-
-    // Cleanup shared memory and semaphores
-    shmdt(gData);
-    shmdt(gProcessProd);
-    shmdt(gDoneProcessCount);
-    shmdt(completed);
-    shmdt(mutex);
+    // Cleanup: the workers exit, and the mapping goes with the last process
+    // that has it, whichever way this one ends
+    StopPool();
+    FreeSharedMemory();
     return 0;
 }
 
-// Sequential FindProduct (no processes)
-int SqFindProd(int size) {
-    int prod = 1;
-    for (int i = 0; i < size; i++) {
-        prod *= gData[i];
-        prod %= NUM_LIMIT;
-        if (gData[i] == 0) break; // Stop if zero is encountered
+// Post a job to the worker processes and wait for them the given way
+void ProcReduce(WaitMode mode, ReduceAcc* total) {
+    int i;
+
+    RunJob(mode);
+    switch (mode) {
+    case WAIT_JOIN:
+        // Parent process waits for all worker processes to finish the job
+        WaitForPool();
+        break;
+    case WAIT_BUSY:
+        // Busy waiting loop on the children's done flags
+        while (1) {
+            int allDone = 1;
+            for (i = 0; i < processCount; i++) {
+                if (!SlotDone(&gProcessSlots[i])) {
+                    allDone = 0;
+                    break;
+                }
+            }
+            if (allDone) break;
+        }
+        break;
+    case WAIT_SEMAPHORE:
+        // The first zero or the last child posts completed
+        sem_wait(completed);
+        break;
+    default:
+        // The first zero or the last child releases the latch
+        LatchWait(gLatch);
+        break;
     }
-    return prod;
+    ReduceMerge(gOp, gProcessAccs, gProcessSlots, processCount, total);
 }
 
-// Process FindProduct
-void ProcessFindProd(int processNum, int startIdx, int endIdx) {
-    int prod = 1;
+// One process-based reduction with the parent waiting the given way. The
+// time runs from posting the job to having the merged result; the workers
+// were forked beforehand, as the threaded version's are created beforehand.
+long TimedProcReduce(WaitMode mode, ReduceAcc* total) {
+    ResetSharedState();
+    long start = GetNanoTime();
+    ProcReduce(mode, total);
+    long ns = GetNanoTime() - start;
+
+    WaitForPool(); // The early-signalling modes don't wait for the rest
+    return ns;
+}
 
-    // Compute the product for the assigned division
-    for (int i = startIdx; i <= endIdx; i++) {
-        prod *= gData[i];
-        prod %= NUM_LIMIT;
-        if (gData[i] == 0) { // If a zero is found, notify parent and exit
-            gProcessProd[processNum] = 0;
-            sem_post(completed); // Notify parent immediately
-            exit(0);
+// Benchmark mode: BENCH_WARMUPS untimed runs, then trials timed ones, of the
+// sequential reduction and of each process experiment (only onlyMode's if it
+// is set), with one summary line per variant
+void RunBenchmark(int trials, int arraySize, int onlyMode) {
+    long* ns = malloc(trials * sizeof(long));
+    ReduceAcc acc;
+    char result[REDUCE_MAX_WIDTH * 24];
+    char variant[32];
+
+    if (ns == NULL) {
+        fprintf(stderr, "Failed to allocate the benchmark trials\n");
+        exit(-1);
+    }
+    for (int v = -1; v < WAIT_MODES; v++) { // -1 is the sequential reduction
+        if (v >= 0 && onlyMode >= 0 && onlyMode != v) {
+            continue;
+        }
+        for (int t = -BENCH_WARMUPS; t < trials; t++) {
+            long d;
+
+            if (v < 0) {
+                long start = GetNanoTime();
+                ReduceInit(gOp, &acc);
+                ReduceRange(gOp, &acc, gData, arraySize);
+                d = GetNanoTime() - start;
+            } else {
+                d = TimedProcReduce(v, &acc);
+            }
+            if (t >= 0) ns[t] = d;
         }
+        ReduceFormat(gOp, &acc, result, sizeof(result));
+        if (v < 0) {
+            snprintf(variant, sizeof(variant), "sequential");
+        } else {
+            snprintf(variant, sizeof(variant), "processes-%s", gWaitModeNames[v]);
+        }
+        PrintBenchmark(variant, v < 0 ? 1 : processCount, arraySize, ns, trials, gOp->label, result);
     }
+    free(ns);
+}
 
-    // Store the product for this process
-    gProcessProd[processNum] = prod;
-
-    // Protect access to gDoneProcessCount with mutex semaphore
-    sem_wait(mutex);
-    (*gDoneProcessCount)++;
-    if (*gDoneProcessCount == processCount) {
-        // All processes are done, so signal the parent
-        sem_post(completed);
+// Process reduction of the division [first, end), a block at a time so the
+// process stops soon after another one has found a zero
+void ProcessReduce(int processNum, long first, long end, WaitMode mode) {
+    ReduceAcc* acc = &gProcessAccs[processNum];
+
+    ReduceInit(gOp, acc);
+    for (long i = first; i < end && !atomic_load_explicit(&gShared->cancel, memory_order_relaxed); i += REDUCE_BLOCK) {
+        long len = end - i < REDUCE_BLOCK ? end - i : REDUCE_BLOCK;
+
+        if (ReduceRange(gOp, acc, gData + i, len)) { // If a zero is found, notify parent and stop
+            atomic_store_explicit(&gShared->cancel, true, memory_order_relaxed);
+            SlotPublish(&gProcessSlots[processNum], 0);
+            if (mode == WAIT_SEMAPHORE) {
+                sem_post(completed); // Notify parent immediately
+            } else if (mode == WAIT_LATCH) {
+                LatchSignalEarly(gLatch);
+            }
+            return;
+        }
     }
-    sem_post(mutex);
-}
 
+    // The accumulator is in place, mark this process done
+    SlotPublish(&gProcessSlots[processNum], 0);
 
-// Multiply the division products to compute the total modular product
-int ComputeTotalProduct() {
-    int i, prod = 1;
-    for (i = 0; i < processCount; i++) {
-        if (gProcessProd[i] == 0) {
-            return 0; // If any process found a zero, the total product is zero
+    if (mode == WAIT_SEMAPHORE) {
+        // Protect access to gDoneProcessCount with mutex semaphore
+        sem_wait(mutex);
+        (*gDoneProcessCount)++;
+        if (*gDoneProcessCount == processCount) {
+            // All processes are done, so signal the parent
+            sem_post(completed);
         }
-        prod *= gProcessProd[i];
+        sem_post(mutex);
+    } else if (mode == WAIT_LATCH) {
+        LatchCountDown(gLatch);
+    }
+}
+
+// prodmod's block with the modulus a constant, which the compiler turns
+// into multiplications instead of a division per element
+void ProdModConstBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    int prod = (int)acc->v[0];
+    (void)op;
+    for (long i = 0; i < len && prod != 0; i++) {
+        prod *= data[i];
         prod %= NUM_LIMIT;
     }
-    return prod;
+    acc->v[0] = prod;
+}
+
+// Reset the result slots, counters, semaphores and latch between experiments
+void ResetSharedState() {
+    SlotsReset(gProcessSlots, processCount, 1);
+    LatchInit(gLatch, processCount);
+    sem_destroy(completed);
+    sem_destroy(mutex);
+    sem_init(completed, 1, 0);
+    sem_init(mutex, 1, 1);
+    *gDoneProcessCount = 0;
 }
 
-// Initialize shared memory
-// Initialize shared memory
+
+// Map one shared anonymous region for everything: the shared state, then the
+// array on its own page. With -H, try reserved huge pages first and fall back
+// to asking for transparent huge pages. Nothing has to be removed afterwards,
+// unlike SysV segments: the mapping is gone once every process is.
 void InitSharedMemory(int size) {
-    int shmDataId = shmget(IPC_PRIVATE, sizeof(int) * size, IPC_CREAT | 0666);
-    if (shmDataId < 0) {
-        perror("shmget failed for gData");
-        exit(1);
-    }
-    int shmProdId = shmget(IPC_PRIVATE, sizeof(int) * MAX_PROCESSES, IPC_CREAT | 0666);
-    if (shmProdId < 0) {
-        perror("shmget failed for gProcessProd");
-        exit(1);
-    }
-    int shmDoneCountId = shmget(IPC_PRIVATE, sizeof(int), IPC_CREAT | 0666);
-    if (shmDoneCountId < 0) {
-        perror("shmget failed for gDoneProcessCount");
-        exit(1);
-    }
-    int shmCompletedId = shmget(IPC_PRIVATE, sizeof(sem_t), IPC_CREAT | 0666);
-    if (shmCompletedId < 0) {
-        perror("shmget failed for completed semaphore");
-        exit(1);
+    pthread_mutexattr_t mutexAttr;
+    pthread_condattr_t condAttr;
+    size_t head = (sizeof(SharedState) + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+    void* region = MAP_FAILED;
+
+    gSharedBytes = head + (size_t)size * sizeof(int);
+#ifdef MAP_HUGETLB
+    if (gHugePages) {
+        size_t hugeBytes = (gSharedBytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        region = mmap(NULL, hugeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        printf("Huge pages: %s\n", region != MAP_FAILED ? "reserved (MAP_HUGETLB)" : "none reserved, using transparent huge pages");
+        if (region != MAP_FAILED) {
+            gSharedBytes = hugeBytes;
+        }
     }
-    int shmMutexId = shmget(IPC_PRIVATE, sizeof(sem_t), IPC_CREAT | 0666);
-    if (shmMutexId < 0) {
-        perror("shmget failed for mutex semaphore");
-        exit(1);
+#endif
+    if (region == MAP_FAILED) {
+        region = mmap(NULL, gSharedBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            perror("mmap failed for the shared region");
+            exit(1);
+        }
+#ifdef MADV_HUGEPAGE
+        if (gHugePages) {
+            madvise(region, gSharedBytes, MADV_HUGEPAGE);
+        }
+#endif
     }
 
-    gData = (int*) shmat(shmDataId, NULL, 0);
-    if (gData == (int*)-1) {
-        perror("shmat failed for gData");
-        exit(1);
+    gShared = region;
+    gData = (int*)((char*)region + head);
+    gProcessAccs = gShared->accs;
+    gProcessSlots = gShared->slots;
+    gLatch = &gShared->latch;
+    gDoneProcessCount = &gShared->doneProcessCount;
+    completed = &gShared->completed;
+    mutex = &gShared->mutex;
+
+    pthread_mutexattr_init(&mutexAttr);
+    pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&gShared->poolLock, &mutexAttr);
+    pthread_mutexattr_destroy(&mutexAttr);
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&gShared->poolWake, &condAttr);
+    pthread_cond_init(&gShared->poolIdle, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
+    sem_init(completed, 1, 0);
+    sem_init(mutex, 1, 1);
+    *gDoneProcessCount = 0;
+}
+
+void FreeSharedMemory() {
+    sem_destroy(completed);
+    sem_destroy(mutex);
+    pthread_cond_destroy(&gShared->poolWake);
+    pthread_cond_destroy(&gShared->poolIdle);
+    pthread_mutex_destroy(&gShared->poolLock);
+    munmap(gShared, gSharedBytes);
+}
+
+// Fork the worker processes. They only ever leave WorkerMain by exiting.
+void StartPool() {
+    fflush(stdout); // Or every child would print the parent's buffered output again on exit
+    for (int w = 0; w < processCount; w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork failed for a worker process");
+            exit(1);
+        }
+        if (pid == 0) { // Child process
+            WorkerMain(w);
+        }
+        gWorkerPids[w] = pid;
     }
-    gProcessProd = (int*) shmat(shmProdId, NULL, 0);
-    if (gProcessProd == (int*)-1) {
-        perror("shmat failed for gProcessProd");
-        exit(1);
+}
+
+// Worker process: sleeps until a job is posted, reduces its division,
+// reports back and sleeps again. It is killed if the parent dies, so an
+// interrupted run leaves nothing behind.
+void WorkerMain(int worker) {
+    int seenGen = 0;
+
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() == 1) { // The parent died before the line above
+        _exit(1);
     }
-    gDoneProcessCount = (int*) shmat(shmDoneCountId, NULL, 0);
-    if (gDoneProcessCount == (int*)-1) {
-        perror("shmat failed for gDoneProcessCount");
-        exit(1);
+#endif
+    PinWorker(worker);
+
+    while (1) {
+        pthread_mutex_lock(&gShared->poolLock);
+        while (!gShared->poolStop && gShared->jobGen == seenGen) {
+            pthread_cond_wait(&gShared->poolWake, &gShared->poolLock);
+        }
+        if (gShared->poolStop) {
+            pthread_mutex_unlock(&gShared->poolLock);
+            _exit(0); // Not exit(): the parent's stdio buffers are not this process's to flush
+        }
+        seenGen = gShared->jobGen;
+        WaitMode mode = gShared->waitMode;
+        pthread_mutex_unlock(&gShared->poolLock);
+
+        long first, end;
+        ReducePartition(gArraySize, processCount, worker, &first, &end);
+        ProcessReduce(worker, first, end, mode);
+
+        pthread_mutex_lock(&gShared->poolLock);
+        if (--gShared->busyWorkers == 0) {
+            pthread_cond_signal(&gShared->poolIdle);
+        }
+        pthread_mutex_unlock(&gShared->poolLock);
     }
-    completed = (sem_t*) shmat(shmCompletedId, NULL, 0);
-    if (completed == (sem_t*)-1) {
-        perror("shmat failed for completed semaphore");
-        exit(1);
+}
+
+// Pin worker w to the w-th CPU this process may run on (wrapping around)
+void PinWorker(int worker) {
+#ifdef __linux__
+    cpu_set_t allowed, one;
+    int nth;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
     }
-    mutex = (sem_t*) shmat(shmMutexId, NULL, 0);
-    if (mutex == (sem_t*)-1) {
-        perror("shmat failed for mutex semaphore");
-        exit(1);
+    nth = worker % CPU_COUNT(&allowed);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed) && nth-- == 0) {
+            CPU_ZERO(&one);
+            CPU_SET(c, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+            break;
+        }
     }
+#else
+    (void)worker;
+#endif
+}
 
-    sem_init(completed, 1, 0);
-    sem_init(mutex, 1, 1);
-    *gDoneProcessCount = 0;
+// Post a job to the worker processes and wake them
+void RunJob(WaitMode mode) {
+    pthread_mutex_lock(&gShared->poolLock);
+    gShared->waitMode = mode;
+    atomic_store(&gShared->cancel, false);
+    gShared->busyWorkers = processCount;
+    gShared->jobGen++;
+    pthread_cond_broadcast(&gShared->poolWake);
+    pthread_mutex_unlock(&gShared->poolLock);
+}
+
+// Wait until every worker process is done with the current job
+void WaitForPool() {
+    pthread_mutex_lock(&gShared->poolLock);
+    while (gShared->busyWorkers > 0) {
+        pthread_cond_wait(&gShared->poolIdle, &gShared->poolLock);
+    }
+    pthread_mutex_unlock(&gShared->poolLock);
 }
 
+// Make the worker processes exit and reap them
+void StopPool() {
+    pthread_mutex_lock(&gShared->poolLock);
+    gShared->poolStop = true;
+    pthread_cond_broadcast(&gShared->poolWake);
+    pthread_mutex_unlock(&gShared->poolLock);
+    for (int w = 0; w < processCount; w++) {
+        waitpid(gWorkerPids[w], NULL, 0);
+    }
+}
 
 // Generate the input array with random numbers, place zero if required
 void GenerateInput(int size, int indexForZero) {
@@ -235,16 +523,6 @@ void GenerateInput(int size, int indexForZero) {
     }
 }
 
-// Calculate the right indices to divide the array into process count equal divisions
-void CalculateIndices(int arraySize, int processCnt, int indices[MAX_PROCESSES][3]) {
-    int chunkSize = arraySize / processCnt;
-    for (int i = 0; i < processCnt; i++) {
-        indices[i][0] = i;
-        indices[i][1] = i * chunkSize;
-        indices[i][2] = (i == processCnt - 1) ? arraySize - 1 : (i + 1) * chunkSize - 1;
-    }
-}
-
 // Get a random number in the range [x, y]
 int GetRand(int x, int y) {
     int r = rand();
@@ -253,27 +531,11 @@ int GetRand(int x, int y) {
 }
 
 // Timing functions
-long GetMilliSecondTime(struct timeb timeBuf) {
-    long mliScndTime;
-    mliScndTime = timeBuf.time;
-    mliScndTime *= 1000;
-    mliScndTime += timeBuf.millitm;
-    return mliScndTime;
-}
-
-long GetCurrentTime(void) {
-    long crntTime = 0;
-    struct timeb timeBuf;
-    ftime(&timeBuf);
-    crntTime = GetMilliSecondTime(timeBuf);
-    return crntTime;
-}
-
 void SetTime(void) {
-    gRefTime = GetCurrentTime();
+    gRefTime = GetNanoTime();
 }
 
+// Milliseconds since SetTime
 long GetTime(void) {
-    long crntTime = GetCurrentTime();
-    return (crntTime - gRefTime);
+    return (GetNanoTime() - gRefTime) / 1000000;
 }
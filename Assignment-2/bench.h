@@ -0,0 +1,45 @@
+/*
+bench.h: nanosecond timing and the summary the benchmark mode (-b) prints,
+shared by MTFindProd.c and MTFindProdExtra.c. findprodbench.sh sweeps both
+programs and reads these summary lines.
+*/
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Untimed runs before the trials of each variant: they fault the pages in,
+// warm the caches and get the workers past their first wakeup
+#define BENCH_WARMUPS 2
+
+static inline long GetNanoTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int CompareNs(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank quantile of sorted samples
+static inline long Quantile(const long* sorted, int cnt, double q) {
+    return sorted[(int)(q * (cnt - 1) + 0.5)];
+}
+
+// Sort the trials and print one line for the variant:
+// "Benchmark <variant>: <workers> workers, <size> elements, <trials> trials,
+//  median <ns> ns, IQR <q1>-<q3> ns, min <ns> ns, max <ns> ns. <label> = <result>"
+static inline void PrintBenchmark(const char* variant, int workers, long size, long* ns, int trials,
+                                  const char* label, const char* result) {
+    qsort(ns, trials, sizeof(long), CompareNs);
+    printf("Benchmark %s: %d workers, %ld elements, %d trials, median %ld ns, IQR %ld-%ld ns, min %ld ns, max %ld ns. %s = %s\n",
+           variant, workers, size, trials, Quantile(ns, trials, 0.5), Quantile(ns, trials, 0.25),
+           Quantile(ns, trials, 0.75), ns[0], ns[trials - 1], label, result);
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+completion.h: ways for a parent to learn that its workers are done, shared by
+MTFindProd.c (threads) and MTFindProdExtra.c (processes). Everything here
+also works in memory shared between processes: plain atomics, and the futex
+is a shared one, not FUTEX_PRIVATE.
+*/
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+// Checks of the latch before the waiter goes to sleep in the kernel
+#define LATCH_SPIN 4000
+
+// How the parent waits for its workers, selectable so they can be compared
+typedef enum { WAIT_JOIN, WAIT_BUSY, WAIT_SEMAPHORE, WAIT_LATCH, WAIT_MODES } WaitMode;
+
+// Wait modes as -w takes them, and as the experiments describe them
+static const char* gWaitModeNames[WAIT_MODES] = { "join", "busy", "sem", "latch" };
+static const char* gWaitModeHow[WAIT_MODES] = { "waiting for all children", "continually checking on children",
+                                                "waiting on a semaphore", "waiting on a latch" };
+
+// Latch states; released is also the futex word
+enum { LATCH_PENDING, LATCH_DONE, LATCH_EARLY };
+
+// Countdown latch: released when count workers have counted down, or at once
+// when one of them signals early because the answer is already known
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_int count;
+    atomic_int released;
+    atomic_int sleepers; // Waiters in the kernel, so releasing skips the wake syscall when there are none
+} Latch;
+
+// One worker's result on its own cache line, so workers publishing side by
+// side don't false-share
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_int value;
+    atomic_bool done;
+} ResultSlot;
+
+static inline void CompletionPause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline void LatchInit(Latch* latch, int count) {
+    atomic_store(&latch->count, count);
+    atomic_store(&latch->released, LATCH_PENDING);
+    atomic_store(&latch->sleepers, 0);
+}
+
+// Only the first release counts. Its store and the waiter's sleepers
+// increment are both seq_cst, so either the waiter sees the release before it
+// sleeps or the release sees the waiter and wakes it.
+static inline void LatchRelease(Latch* latch, int how) {
+    int expected = LATCH_PENDING;
+
+    if (atomic_compare_exchange_strong(&latch->released, &expected, how) && atomic_load(&latch->sleepers) > 0) {
+#ifdef __linux__
+        syscall(SYS_futex, (int*)&latch->released, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    }
+}
+
+// A worker is done; the last one releases the latch
+static inline void LatchCountDown(Latch* latch) {
+    if (atomic_fetch_sub(&latch->count, 1) == 1) {
+        LatchRelease(latch, LATCH_DONE);
+    }
+}
+
+// A worker already knows the answer: release the waiter without the others
+static inline void LatchSignalEarly(Latch* latch) {
+    LatchRelease(latch, LATCH_EARLY);
+}
+
+// Spin a while, then sleep on the futex. True if the latch was released early.
+static inline bool LatchWait(Latch* latch) {
+    int state;
+
+    for (int i = 0; i < LATCH_SPIN; i++) {
+        if ((state = atomic_load(&latch->released)) != LATCH_PENDING) {
+            return state == LATCH_EARLY;
+        }
+        CompletionPause();
+    }
+    atomic_fetch_add(&latch->sleepers, 1);
+    while ((state = atomic_load(&latch->released)) == LATCH_PENDING) {
+#ifdef __linux__
+        syscall(SYS_futex, (int*)&latch->released, FUTEX_WAIT, LATCH_PENDING, NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+    atomic_fetch_sub(&latch->sleepers, 1);
+    return state == LATCH_EARLY;
+}
+
+static inline void SlotsReset(ResultSlot* slots, int cnt, int value) {
+    for (int i = 0; i < cnt; i++) {
+        atomic_store_explicit(&slots[i].value, value, memory_order_relaxed);
+        atomic_store_explicit(&slots[i].done, false, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+// The value is visible to anyone who sees done
+static inline void SlotPublish(ResultSlot* slot, int value) {
+    atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+    atomic_store_explicit(&slot->done, true, memory_order_release);
+}
+
+static inline bool SlotDone(ResultSlot* slot) {
+    return atomic_load_explicit(&slot->done, memory_order_acquire);
+}
+
+static inline int SlotValue(ResultSlot* slot) {
+    return atomic_load_explicit(&slot->value, memory_order_relaxed);
+}
+
+// Parse a -w argument: join, busy, sem or latch. -1 if it is none of them.
+static inline int ParseWaitMode(const char* name) {
+    for (int m = 0; m < WAIT_MODES; m++) {
+        if (strcmp(name, gWaitModeNames[m]) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# Scaling sweep for MTFindProd (threads) and MTFindProdExtra (processes).
+#
+# Builds both programs into a scratch directory and runs each in benchmark
+# mode (-b) for every combination of array size and worker count. Every
+# variant, the sequential reduction and each way the parent can wait, gets
+# warm-up runs and then the timed trials. The script prints one row per
+# variant as CSV (default) or JSON (-j). Speedup and parallel efficiency are
+# relative to the sequential median of the same program on the same array.
+# Both programs make their pool of workers, threads or processes, before
+# anything is timed.
+#
+# Usage: ./findprodbench.sh [-j] [-t trials]
+# The sweep can be changed through SIZES, WORKER_CNTS, PROGRAMS and OP, e.g.
+#   SIZES="1000000" WORKER_CNTS="1 2 4" OP=sum ./findprodbench.sh -j > bench.json
+
+SIZES=${SIZES:-"1000000 10000000 100000000"}
+WORKER_CNTS=${WORKER_CNTS:-"1 2 4 8 16"}
+PROGRAMS=${PROGRAMS:-"MTFindProd MTFindProdExtra"}
+OP=${OP:-"prodmod"}
+CFLAGS=${CFLAGS:-"-O2"}
+
+json=0
+trials=10
+while getopts "jt:" opt; do
+    case $opt in
+    j) json=1 ;;
+    t) trials=$OPTARG ;;
+    *) echo "Usage: $0 [-j] [-t trials]" >&2; exit 1 ;;
+    esac
+done
+
+srcDir=$(cd "$(dirname "$0")" && pwd)
+buildDir=$(mktemp -d)
+trap 'rm -rf "$buildDir"' EXIT
+
+for prog in $PROGRAMS; do
+    gcc $CFLAGS -pthread -o "$buildDir/$prog" "$srcDir/$prog.c" || exit 1
+done
+cd "$buildDir" || exit 1
+
+if [ $json -eq 1 ]; then
+    echo "["
+else
+    echo "program,variant,size,workers,trials,medianNs,q1Ns,q3Ns,minNs,maxNs,speedup,efficiency"
+fi
+
+first=1
+firstWorkers=${WORKER_CNTS%% *}
+for prog in $PROGRAMS; do
+    for size in $SIZES; do
+        for workers in $WORKER_CNTS; do
+            out=$(./"$prog" "$size" "$workers" -1 -o "$OP" -b "$trials")
+
+            # "Benchmark V: W workers, S elements, T trials, median M ns, IQR Q1-Q3 ns, min A ns, max B ns. ..."
+            rows=$(echo "$out" | sed -n 's/^Benchmark \([^:]*\): \([0-9]*\) workers, [0-9]* elements, [0-9]* trials, median \([0-9]*\) ns, IQR \([0-9]*\)-\([0-9]*\) ns, min \([0-9]*\) ns, max \([0-9]*\) ns\..*/\1 \2 \3 \4 \5 \6 \7/p')
+            seqMedian=$(echo "$rows" | awk '$1 == "sequential" { print $3 }')
+            if [ -z "$seqMedian" ]; then
+                echo "Run failed: $prog size=$size workers=$workers" >&2
+                continue
+            fi
+
+            while read -r variant w median q1 q3 min max; do
+                # One sequential row per size, not one per worker count
+                [ "$variant" = "sequential" ] && [ "$workers" != "$firstWorkers" ] && continue
+                read -r speedup efficiency <<< "$(awk -v s="$seqMedian" -v m="$median" -v w="$w" \
+                    'BEGIN { printf "%.3f %.3f", s / m, s / m / w }')"
+
+                if [ $json -eq 1 ]; then
+                    [ $first -eq 1 ] || echo ","
+                    printf '  {"program": "%s", "variant": "%s", "size": %d, "workers": %d, "trials": %d, "medianNs": %d, "q1Ns": %d, "q3Ns": %d, "minNs": %d, "maxNs": %d, "speedup": %s, "efficiency": %s}' \
+                        "$prog" "$variant" "$size" "$w" "$trials" "$median" "$q1" "$q3" "$min" "$max" "$speedup" "$efficiency"
+                else
+                    echo "$prog,$variant,$size,$w,$trials,$median,$q1,$q3,$min,$max,$speedup,$efficiency"
+                fi
+                first=0
+            done <<< "$rows"
+        done
+    done
+done
+
+if [ $json -eq 1 ]; then
+    echo
+    echo "]"
+fi
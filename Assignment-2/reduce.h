@@ -0,0 +1,226 @@
+/*
+reduce.h: reduction engine shared by MTFindProd.c (threads) and
+MTFindProdExtra.c (processes). An operator is an identity, a block loop that
+folds elements into an accumulator, a combine for two accumulators and an
+optional absorbing value: once an accumulator holds it, nothing can change the
+result, which is how the product stops at a zero. The programs supply the
+backends, their thread pool or their forked processes; partitioning, the loop
+over a range and the merging of results are here, so every backend does them
+the same way.
+*/
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include "completion.h"
+
+#define REDUCE_MAX_WIDTH 16 // int64 words in an accumulator, enough for the histogram
+#define REDUCE_HIST_BUCKETS 16
+#define REDUCE_BLOCK 16384 // Elements ReduceRange folds between checks for the absorbing value
+
+// Accumulator for any operator, padded so per-worker ones don't false-share
+typedef struct {
+    _Alignas(CACHE_LINE) int64_t v[REDUCE_MAX_WIDTH];
+} ReduceAcc;
+
+typedef struct ReduceOp ReduceOp;
+struct ReduceOp {
+    const char* name; // As given to -o
+    const char* task; // "Sequential <task> completed ..."
+    const char* label; // "... <label> = <result>"
+    int width; // Words of the accumulator in use
+    int64_t identity; // Every word starts here
+    int64_t param; // Modulus for prodmod, largest value for hist (see ReduceConfigure)
+    void (*block)(const ReduceOp* op, ReduceAcc* acc, const int* data, long len); // Fold len elements into acc
+    void (*combine)(const ReduceOp* op, ReduceAcc* acc, const ReduceAcc* other); // acc = acc op other
+    bool hasAbsorbing;
+    int64_t absorbing; // Compared with word 0, so only for width 1 operators
+};
+
+// Block loops, one per operator so each is a plain loop the compiler can
+// vectorize; they keep their partial result in a local and touch acc once
+
+static void SumBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    int64_t sum = 0;
+    (void)op;
+    for (long i = 0; i < len; i++) {
+        sum += data[i];
+    }
+    acc->v[0] += sum;
+}
+
+static void MinBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    int min = INT_MAX;
+    (void)op;
+    for (long i = 0; i < len; i++) {
+        min = data[i] < min ? data[i] : min;
+    }
+    if (min < acc->v[0]) acc->v[0] = min;
+}
+
+static void MaxBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    int max = INT_MIN;
+    (void)op;
+    for (long i = 0; i < len; i++) {
+        max = data[i] > max ? data[i] : max;
+    }
+    if (max > acc->v[0]) acc->v[0] = max;
+}
+
+static void XorBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    uint32_t x = 0;
+    (void)op;
+    for (long i = 0; i < len; i++) {
+        x ^= (uint32_t)data[i];
+    }
+    acc->v[0] ^= x;
+}
+
+// REDUCE_HIST_BUCKETS equal buckets over [0, param]; values outside go to the end buckets
+static void HistBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    int64_t counts[REDUCE_HIST_BUCKETS] = { 0 };
+    for (long i = 0; i < len; i++) {
+        int64_t b = (int64_t)data[i] * REDUCE_HIST_BUCKETS / (op->param + 1);
+        counts[b < 0 ? 0 : b >= REDUCE_HIST_BUCKETS ? REDUCE_HIST_BUCKETS - 1 : b]++;
+    }
+    for (int b = 0; b < REDUCE_HIST_BUCKETS; b++) {
+        acc->v[b] += counts[b];
+    }
+}
+
+// One element at a time, stopping once the product is 0. Programs with a
+// faster kernel for their modulus plug it in instead (MTFindProd does).
+// % keeps the sign of a negative element, so the result is normalized to
+// [0, param) once at the end; in between it stays within (-param, param).
+static void ProdModBlock(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    int64_t prod = acc->v[0];
+    for (long i = 0; i < len && prod != 0; i++) {
+        prod = prod * data[i] % op->param;
+    }
+    acc->v[0] = ((prod % op->param) + op->param) % op->param;
+}
+
+static void SumCombine(const ReduceOp* op, ReduceAcc* acc, const ReduceAcc* other) {
+    (void)op;
+    acc->v[0] += other->v[0];
+}
+
+static void MinCombine(const ReduceOp* op, ReduceAcc* acc, const ReduceAcc* other) {
+    (void)op;
+    if (other->v[0] < acc->v[0]) acc->v[0] = other->v[0];
+}
+
+static void MaxCombine(const ReduceOp* op, ReduceAcc* acc, const ReduceAcc* other) {
+    (void)op;
+    if (other->v[0] > acc->v[0]) acc->v[0] = other->v[0];
+}
+
+static void XorCombine(const ReduceOp* op, ReduceAcc* acc, const ReduceAcc* other) {
+    (void)op;
+    acc->v[0] ^= other->v[0];
+}
+
+static void HistCombine(const ReduceOp* op, ReduceAcc* acc, const ReduceAcc* other) {
+    for (int b = 0; b < op->width; b++) {
+        acc->v[b] += other->v[b];
+    }
+}
+
+static void ProdModCombine(const ReduceOp* op, ReduceAcc* acc, const ReduceAcc* other) {
+    acc->v[0] = ((acc->v[0] * other->v[0] % op->param) + op->param) % op->param;
+}
+
+static ReduceOp gReduceOps[] = {
+    { .name = "prodmod", .task = "multiplication", .label = "Product", .width = 1, .identity = 1,
+      .block = ProdModBlock, .combine = ProdModCombine, .hasAbsorbing = true, .absorbing = 0 },
+    { .name = "sum", .task = "sum", .label = "Sum", .width = 1, .identity = 0,
+      .block = SumBlock, .combine = SumCombine },
+    { .name = "min", .task = "minimum", .label = "Min", .width = 1, .identity = INT64_MAX,
+      .block = MinBlock, .combine = MinCombine },
+    { .name = "max", .task = "maximum", .label = "Max", .width = 1, .identity = INT64_MIN,
+      .block = MaxBlock, .combine = MaxCombine },
+    { .name = "xor", .task = "xor", .label = "Xor", .width = 1, .identity = 0,
+      .block = XorBlock, .combine = XorCombine },
+    { .name = "hist", .task = "histogram", .label = "Histogram", .width = REDUCE_HIST_BUCKETS, .identity = 0,
+      .block = HistBlock, .combine = HistCombine },
+};
+
+#define REDUCE_OP_CNT ((int)(sizeof(gReduceOps) / sizeof(gReduceOps[0])))
+
+// Look an operator up by its -o name, NULL if there is none
+static inline ReduceOp* ReduceFindOp(const char* name) {
+    for (int i = 0; i < REDUCE_OP_CNT; i++) {
+        if (strcmp(gReduceOps[i].name, name) == 0) {
+            return &gReduceOps[i];
+        }
+    }
+    return NULL;
+}
+
+// The product's modulus and the histogram's range come from the program
+static inline void ReduceConfigure(int64_t modulus, int64_t maxValue) {
+    ReduceFindOp("prodmod")->param = modulus;
+    ReduceFindOp("hist")->param = maxValue;
+}
+
+static inline void ReduceInit(const ReduceOp* op, ReduceAcc* acc) {
+    for (int i = 0; i < op->width; i++) {
+        acc->v[i] = op->identity;
+    }
+}
+
+static inline bool ReduceAbsorbed(const ReduceOp* op, const ReduceAcc* acc) {
+    return op->hasAbsorbing && acc->v[0] == op->absorbing;
+}
+
+// Fold data[0, len) into acc a block at a time, stopping once acc absorbs.
+// True if it did.
+static inline bool ReduceRange(const ReduceOp* op, ReduceAcc* acc, const int* data, long len) {
+    for (long i = 0; i < len; i += REDUCE_BLOCK) {
+        op->block(op, acc, data + i, len - i < REDUCE_BLOCK ? len - i : REDUCE_BLOCK);
+        if (ReduceAbsorbed(op, acc)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Part `part` of `parts` near-equal contiguous parts of [0, len)
+static inline void ReducePartition(long len, int parts, int part, long* first, long* end) {
+    *first = len * part / parts;
+    *end = len * (part + 1) / parts;
+}
+
+// Combine the workers' accumulators in worker order. With slots, a worker
+// that isn't done yet is skipped: the parent only gets here before everyone
+// is done when some worker has absorbed, and that decides the result.
+static inline void ReduceMerge(const ReduceOp* op, const ReduceAcc* accs, ResultSlot* slots, int cnt, ReduceAcc* out) {
+    ReduceInit(op, out);
+    for (int i = 0; i < cnt; i++) {
+        if (slots != NULL && !SlotDone(&slots[i])) {
+            continue;
+        }
+        op->combine(op, out, &accs[i]);
+        if (ReduceAbsorbed(op, out)) {
+            return;
+        }
+    }
+}
+
+// The result as text: one number, or the words separated by spaces
+static inline void ReduceFormat(const ReduceOp* op, const ReduceAcc* acc, char* buf, size_t size) {
+    size_t used = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < op->width && used < size; i++) {
+        int n = snprintf(buf + used, size - used, i == 0 ? "%lld" : " %lld", (long long)acc->v[i]);
+        if (n < 0) break;
+        used += (size_t)n;
+    }
+}
+
+#endif
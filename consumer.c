@@ -1,120 +1,1377 @@
-/*
-CSC139 
-Fall 2024
-First Assignment
-Sario, Ryan
-Section 01
-OSs Tested on: Linux, Mac
-*/
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <fcntl.h>
-#include <sys/shm.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
-#include <string.h>
-
-#define SHM_SIZE 4096
-
-void* gShmPtr;
-
-void SetIn(int);
-void SetOut(int);
-void SetHeaderVal(int, int);
-int GetBufSize();
-int GetItemCnt();
-int GetIn();
-int GetOut();
-int GetHeaderVal(int);
-void WriteAtBufIndex(int, int);
-int ReadAtBufIndex(int);
-
-int main() {
-    const char *name = "OS_HW1_ryanSario";
-    int bufSize;
-    int itemCnt;
-    int in;
-    int out;
-
-    int shm_fd = shm_open(name, O_RDWR, 0666);
-    if (shm_fd == -1) {
-        printf("Consumer: Failed to open shared memory block.\n");
-        exit(1);
-    }
-
-    gShmPtr = mmap(0, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (gShmPtr == MAP_FAILED) {
-        printf("Consumer: Failed to map shared memory.\n");
-        exit(1);
-    }
-
-    bufSize = GetBufSize();
-    itemCnt = GetItemCnt();
-    in = GetIn();
-    out = GetOut();
-
-    printf("Consumer reading: bufSize = %d, itemCnt = %d\n", bufSize, itemCnt);
-
-    for (int i = 0; i < itemCnt; i++) {
-        while (in == out) {
-            in = GetIn(); // Wait until there is something to consume
-
-            // If the producer is done and the buffer is empty, terminate the consumer
-            if (GetProducerDone() == 1 && in == out) {
-                printf("No more items to consume, exiting.\n");
-                exit(0);
-            }
-        }
-
-        int val = ReadAtBufIndex(out);
-        printf("Consuming Item %d with value %d at Index %d\n", i, val, out);
-
-        out = (out + 1) % bufSize; // Update out index
-        SetOut(out);
-    }
-
-    // Clean up shared memory
-    if (shm_unlink(name) == -1) {
-        printf("Error removing %s\n", name);
-        exit(1);
-    }
-
-    return 0;
-}
-
-// Check if the producer has completed
-int GetProducerDone() {
-    return GetHeaderVal(4);  // Assume this flag is at index 4 in shared memory
-}
-
-
-void SetIn(int val) { SetHeaderVal(2, val); }
-void SetOut(int val) { SetHeaderVal(3, val); }
-
-int GetHeaderVal(int i)
-{
-    int val;
-    void* ptr = gShmPtr + i * sizeof(int);
-    memcpy(&val, ptr, sizeof(int));
-    return val;
-}
-
-void SetHeaderVal(int i, int val)
-{
-    void* ptr = gShmPtr + i * sizeof(int);
-    memcpy(ptr, &val, sizeof(int));
-}
-
-int GetBufSize() { return GetHeaderVal(0); }
-int GetItemCnt() { return GetHeaderVal(1); }
-int GetIn() { return GetHeaderVal(2); }
-int GetOut() { return GetHeaderVal(3); }
-
-int ReadAtBufIndex(int indx)
-{
-    void* ptr = gShmPtr + 4 * sizeof(int) + indx * sizeof(int);
-    int val;
-    memcpy(&val, ptr, sizeof(int));
-    return val;
-}
+/*
+CSC139 
+Fall 2024
+First Assignment
+Sario, Ryan
+Section 01
+OSs Tested on: Linux, Mac
+*/
+
+#define _GNU_SOURCE // For sched_setaffinity and the CPU_SET macros
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#endif
+
+// Cache line size, used to keep the producer's and consumer's indices apart
+#define CACHE_LINE 64
+
+// Events per event-log buffer, and buffers in flight to the writer thread
+#define LOG_BUF_EVENTS 65536
+#define LOG_BUF_CNT 4
+
+// Longest event log path prefix kept in the header
+#define LOG_PATH_LEN 128
+
+// Most latency samples kept with -T; longer runs sample every Nth item
+#define MAX_LAT_SAMPLES (1 << 22)
+
+// Most CPUs accepted in a -p/-c pinning list
+#define MAX_PIN_CPUS 64
+
+// Identifies a ring header, and its layout version (must match producer.c)
+#define RING_MAGIC 0x52494E47
+#define RING_VERSION 3
+
+// Modulus of the product computed with -W (as in Assignment-2/MTFindProd.c)
+#define NUM_LIMIT 9973
+
+// Most rings one consumer serves with -R
+#define MAX_RINGS 64
+
+// Queue depth histogram buckets: fill level in eighths of the ring, 0/8 to 8/8
+#define DEPTH_BUCKETS 9
+
+// Records in message mode start on this boundary
+#define FRAME_ALIGN 8
+
+// Frame length that marks the rest of the buffer as padding
+#define FRAME_PAD 0xFFFFFFFFu
+
+// Counters for one side of the ring, on their own cache lines. Only that side
+// writes them; ringstat reads them while the ring runs.
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ulong items; // Items moved
+    atomic_ulong stalls; // Waits on a full (producer) or empty (consumer) ring
+    atomic_ulong spins; // Busy-wait iterations while stalled
+    atomic_ulong sleeps; // Times the side went to sleep while stalled
+    atomic_ulong depthHist[DEPTH_BUCKETS]; // Depth seen each time the other index is re-read
+} SideStats;
+
+// Layout of the shared memory header (must match producer.c)
+typedef struct {
+    unsigned int magic; // RING_MAGIC
+    unsigned int version; // RING_VERSION
+    size_t shmSize; // Size of the whole segment, so the consumer can map it
+    int hugePages;
+    int bufSize;
+    unsigned int mask;
+    int itemCnt;
+    int spinUsec;
+    int yieldCnt;
+    int batchSize;
+    int maxMsgLen; // Non-zero in message mode
+    int mpmc; // Non-zero when the buffer holds MpmcSlots
+    int producerCnt;
+    int consumerCnt;
+    int quiet; // Skip per-item output
+    int stampTimes; // Item values are send times, for latency measurement
+    char logPath[LOG_PATH_LEN]; // Event log path prefix, empty for none
+    int consumerCpus[MAX_PIN_CPUS]; // Consumer N pins itself to consumerCpus[N % consumerCpuCnt]
+    int consumerCpuCnt;
+    int persistent; // Ring lives in a file and survives restarts
+    int syncInterval; // Items between msyncs in persistent mode
+    int reduceWorkers; // Consumer threads computing the product mod NUM_LIMIT, 0 for none
+    atomic_int producerDone;
+    atomic_int consumerDone;
+    _Alignas(CACHE_LINE) atomic_uint in;
+    atomic_int consumerSleeping;
+    _Alignas(CACHE_LINE) atomic_uint out;
+    atomic_int producerSleeping;
+    // Last "in"/"out" known to be on disk in persistent mode; a restart resumes from here
+    _Alignas(CACHE_LINE) unsigned int durableIn;
+    unsigned int durableOut;
+    SideStats prodStats;
+    SideStats consStats;
+    _Alignas(CACHE_LINE) int buf[]; // The bounded buffer itself
+} ShmHeader;
+
+// A ring served by the event loop (-R), with this side's state for it
+typedef struct {
+    const char* name;
+    ShmHeader* hdr;
+    unsigned int out;
+    int doorbell; // eventfd the producer writes when we sleep, in the epoll set
+    int done;
+    long items;
+    long valSum;
+} Ring;
+
+// A run of buffer slots, split in two when it wraps past the end of the buffer
+typedef struct {
+    int* first;
+    int firstLen;
+    int* second;
+    int secondLen;
+} RingSpan;
+
+// Start of every record in message mode (must match producer.c)
+typedef struct {
+    unsigned int len; // Payload bytes following the header, or FRAME_PAD
+    int itemNum;
+} FrameHdr;
+
+// Buffer slot in MPMC mode (must match producer.c)
+typedef struct {
+    atomic_uint seq;
+    int val;
+} MpmcSlot;
+
+// One record in the binary event log (-L). The producer and consumer each
+// write their own file of these, in the order they moved the items.
+typedef struct {
+    long timeNs; // CLOCK_MONOTONIC
+    int itemNum;
+    int val; // Item value, or the payload checksum in message mode
+    int indx; // Slot index, or the frame offset in message mode
+    int len; // Payload bytes
+} LogEvent;
+
+// Binary event log. The hot path fills bufs[head]; full buffers are written
+// by a background thread so the producer/consumer never block on the file
+// unless the writer falls LOG_BUF_CNT buffers behind.
+typedef struct {
+    LogEvent* bufs[LOG_BUF_CNT];
+    int fill[LOG_BUF_CNT];
+    int head; // Buffer being filled
+    int tail; // Next buffer to write out
+    int full; // Buffers waiting for the writer
+    int closing;
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} EventLog;
+
+// Progress of one spin-then-yield-then-sleep wait
+typedef struct {
+    long start;
+    int spins;
+    int yields;
+} Backoff;
+
+void* gShmPtr;
+ShmHeader* gHdr;
+
+// Event log and end-of-run statistics for this process
+EventLog gLog;
+int gLogging = 0;
+long gValSum = 0;
+
+// One-way latency samples in ns, recorded when items carry send times
+unsigned int* gLatency;
+long gLatencyCnt = 0;
+int gLatencyStride = 1;
+
+// Consumer-side ring state: our own index and a cached copy of the producer's
+unsigned int gOut;
+unsigned int gInCache;
+unsigned int gPendingFrame; // Bytes returned by PeekMsg, released by ReleaseMsg
+unsigned int gSyncedOut; // "out" as of the last msync in persistent mode
+
+// Reduction state (-W). Workers claim batches by moving gClaim past them.
+// A finished batch is parked in gDoneLen/gDoneProd at its first slot, and
+// whoever holds gReleaseLock folds parked batches into gProd in stream order,
+// moving gReleased (and "out") past them.
+atomic_uint gClaim;
+unsigned int gReleased;
+int* gDoneLen;
+long* gDoneProd;
+long gProd = 1; // Product mod NUM_LIMIT of everything released so far
+pthread_mutex_t gReleaseLock = PTHREAD_MUTEX_INITIALIZER;
+
+void SetOut(unsigned int);
+int GetBufSize();
+int GetItemCnt();
+unsigned int GetIn();
+unsigned int GetOut();
+int GetProducerDone();
+int Consumer(int, int);
+void ConsumerMsg(int);
+int ConsumerMpmc(int);
+int ConsumerReduce(int);
+void* ReduceWorker(void*);
+int ClaimBatch(unsigned int*);
+void ReleaseBatch(unsigned int, int, long, long);
+long ReduceBatch(const int*, int, long*);
+int MpmcDequeue(int*, int*);
+void MpmcBackoff(Backoff*, atomic_uint*, unsigned int);
+unsigned int WaitForAvail(unsigned int);
+RingSpan PeekRead(int);
+void ReleaseRead(int);
+void SyncConsumer();
+void StatAdd(atomic_ulong*, unsigned long);
+void RecordDepth(unsigned int);
+ShmHeader* MapRing(int);
+void ServeRings(char**, int);
+void AttachRing(Ring*, const char*);
+int DrainRing(Ring*);
+void DetachRing(Ring*);
+int RecvDoorbell(const char*);
+socklen_t GetDoorbellAddr(struct sockaddr_un*, const char*);
+RingSpan MakeSpan(unsigned int, int);
+void ConsumeFrom(int*, int, int);
+const void* PeekMsg(int*);
+void ReleaseMsg();
+unsigned int FrameSize(int);
+unsigned int WaitForItems(unsigned int);
+void WakeProducer();
+void FutexWait(atomic_uint*, unsigned int);
+void FutexWake(atomic_uint*, int);
+void OpenEventLog(const char*);
+void LogItem(int, int, int, int);
+void HandOffLogBuf();
+void* EventLogWriter(void*);
+void CloseEventLog();
+void PrintSummary(const char*, long, long);
+void InitLatency(int);
+void RecordLatency(long, int);
+void PrintLatency(const char*);
+int CompareUint(const void*, const void*);
+void PinToCpu(int);
+void ReportPlacement(const char*);
+int ReadCpuTopology(unsigned int, const char*);
+void CpuRelax();
+long GetMicroTime();
+
+int main(int argc, char* argv[]) {
+    const char *name = "OS_HW1_ryanSario";
+    int bufSize;
+    int itemCnt;
+    int consumerNum = 0; // Set by the producer in MPMC mode
+    char* ringFile = NULL; // Set by the producer for a persistent ring
+    char* ringNames[MAX_RINGS]; // Rings to serve from one event loop
+    int ringCnt = 0;
+    char label[LOG_PATH_LEN];
+    long start;
+    unsigned int first;
+    int opt;
+    int shm_fd;
+
+    // Usage: consumer [-f ringFile] [-n ringName] [consumerNum], as launched by the
+    // producer, or consumer -R ringName [-R ringName ...] to serve rings whose
+    // producers were started with -E
+    while ((opt = getopt(argc, argv, "f:n:R:")) != -1) {
+        switch (opt) {
+        case 'f': ringFile = optarg; break;
+        case 'n': name = optarg; break;
+        case 'R':
+            if (ringCnt == MAX_RINGS) {
+                printf("Consumer: At most %d rings can be served.\n", MAX_RINGS);
+                exit(1);
+            }
+            ringNames[ringCnt++] = optarg;
+            break;
+        default:
+            printf("Usage: %s [-f ringFile] [-n ringName] [consumerNum] | -R ringName ...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        consumerNum = atoi(argv[optind]);
+    }
+
+    if (ringCnt > 0) {
+        ServeRings(ringNames, ringCnt);
+        return 0;
+    }
+
+    if (ringFile != NULL) {
+        shm_fd = open(ringFile, O_RDWR);
+    } else {
+        shm_fd = shm_open(name, O_RDWR, 0666);
+    }
+    if (shm_fd == -1) {
+        printf("Consumer: Failed to open shared memory block.\n");
+        exit(1);
+    }
+    gHdr = MapRing(shm_fd);
+    gShmPtr = gHdr;
+
+    bufSize = GetBufSize();
+    itemCnt = GetItemCnt();
+    gInCache = GetIn();
+    gOut = GetOut();
+    first = gOut; // Non-zero when resuming a persistent ring
+
+    printf("Consumer reading: bufSize = %d, itemCnt = %d\n", bufSize, itemCnt);
+
+    // Pin before touching the ring so this side's cache and stack stay local
+    if (gHdr->consumerCpuCnt > 0) {
+        PinToCpu(gHdr->consumerCpus[consumerNum % gHdr->consumerCpuCnt]);
+    }
+    snprintf(label, sizeof(label), "Consumer %d", consumerNum);
+    ReportPlacement(label);
+
+    if (gHdr->logPath[0] != '\0') {
+        snprintf(label, sizeof(label), "%.100s.cons%d", gHdr->logPath, consumerNum);
+        OpenEventLog(label);
+    }
+
+    if (gHdr->stampTimes) {
+        InitLatency(itemCnt);
+    }
+
+    start = GetMicroTime();
+    if (gHdr->mpmc) {
+        itemCnt = ConsumerMpmc(consumerNum);
+    } else if (gHdr->maxMsgLen > 0) {
+        ConsumerMsg(itemCnt);
+    } else if (gHdr->reduceWorkers > 0) {
+        itemCnt = ConsumerReduce(gHdr->reduceWorkers);
+        printf("Consumer product mod %d = %ld\n", NUM_LIMIT, gProd);
+    } else {
+        itemCnt = Consumer(itemCnt, gHdr->batchSize);
+    }
+    snprintf(label, sizeof(label), "Consumer %d", consumerNum);
+    PrintSummary(label, itemCnt - first, start);
+    if (gHdr->stampTimes) {
+        PrintLatency(label);
+    }
+    CloseEventLog();
+
+    // Clean up shared memory once the last consumer is done with it. A
+    // persistent ring file is kept for the next run.
+    if (atomic_fetch_add(&gHdr->consumerDone, 1) + 1 == gHdr->consumerCnt && !gHdr->persistent &&
+        shm_unlink(name) == -1) {
+        printf("Error removing %s\n", name);
+        exit(1);
+    }
+
+    return 0;
+}
+
+// Read itemCnt ints in batches of up to batchSize. Returns the number of the
+// item after the last one read, which is less than itemCnt if the producer's
+// input ran out early.
+int Consumer(int itemCnt, int batchSize) {
+    int i;
+
+    gSyncedOut = gOut;
+
+    for (i = gOut; i < itemCnt; ) {
+        int n = itemCnt - i < batchSize ? itemCnt - i : batchSize;
+        RingSpan span = PeekRead(n);
+
+        n = span.firstLen + span.secondLen;
+        if (n == 0) {
+            // The producer is done and the buffer is empty
+            printf("No more items to consume, exiting.\n");
+            break;
+        }
+
+        ConsumeFrom(span.first, span.firstLen, i);
+        ConsumeFrom(span.second, span.secondLen, i + span.firstLen);
+
+        ReleaseRead(n); // Hands the whole batch back to the producer
+        i += n;
+
+        if (gHdr->persistent && gOut - gSyncedOut >= (unsigned int)gHdr->syncInterval) {
+            SyncConsumer();
+        }
+    }
+
+    if (gHdr->persistent) {
+        SyncConsumer();
+    }
+    return i;
+}
+
+// Map a whole ring segment, checking its header first
+ShmHeader* MapRing(int shm_fd)
+{
+    ShmHeader* hdr;
+
+    // Map just the header first to learn how big the segment is
+    hdr = mmap(0, sizeof(ShmHeader), PROT_READ, MAP_SHARED, shm_fd, 0);
+    if (hdr == MAP_FAILED) {
+        printf("Consumer: Failed to map shared memory.\n");
+        exit(1);
+    }
+    if (hdr->magic != RING_MAGIC || hdr->version != RING_VERSION) {
+        printf("Consumer: Shared memory is not a version %d ring.\n", RING_VERSION);
+        exit(1);
+    }
+    size_t shmSize = hdr->shmSize;
+    munmap(hdr, sizeof(ShmHeader));
+
+    hdr = mmap(0, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (hdr == MAP_FAILED) {
+        printf("Consumer: Failed to map shared memory.\n");
+        exit(1);
+    }
+    close(shm_fd);
+
+#ifdef MADV_HUGEPAGE
+    if (hdr->hugePages) {
+        madvise(hdr, shmSize, MADV_HUGEPAGE);
+    }
+#endif
+    return hdr;
+}
+
+#ifdef __linux__
+// Event loop for -R: drain whichever rings have items, and once all of them
+// are empty sleep in epoll_wait until a producer rings a doorbell. One thread
+// serves every ring without spinning on any of them.
+void ServeRings(char** names, int ringCnt)
+{
+    Ring rings[MAX_RINGS];
+    struct epoll_event events[MAX_RINGS];
+    int epfd = epoll_create1(0);
+    int openCnt = ringCnt;
+    long items = 0;
+    long start;
+
+    if (epfd == -1) {
+        printf("Consumer: Failed to create the epoll set.\n");
+        exit(1);
+    }
+    for (int r = 0; r < ringCnt; r++) {
+        struct epoll_event ev;
+
+        AttachRing(&rings[r], names[r]);
+        ev.events = EPOLLIN;
+        ev.data.u32 = r;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, rings[r].doorbell, &ev) == -1) {
+            printf("Consumer: Failed to watch ring %s.\n", names[r]);
+            exit(1);
+        }
+    }
+
+    start = GetMicroTime();
+    while (openCnt > 0) {
+        int drained = 0;
+        int ready = 0;
+
+        for (int r = 0; r < ringCnt; r++) {
+            if (!rings[r].done) {
+                drained += DrainRing(&rings[r]);
+                openCnt -= rings[r].done;
+            }
+        }
+        if (drained > 0 || openCnt == 0) {
+            continue;
+        }
+
+        // Announce the sleep on every open ring, then re-check them all so a
+        // publish in between isn't missed (pairs with the producer's fence)
+        for (int r = 0; r < ringCnt; r++) {
+            if (!rings[r].done) {
+                gHdr = rings[r].hdr;
+                StatAdd(&gHdr->consStats.stalls, 1);
+                atomic_fetch_add(&gHdr->consumerSleeping, 1);
+            }
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        for (int r = 0; r < ringCnt; r++) {
+            ShmHeader* hdr = rings[r].hdr;
+            if (!rings[r].done && (atomic_load(&hdr->in) != rings[r].out ||
+                                   atomic_load(&hdr->producerDone) == hdr->producerCnt)) {
+                ready = 1;
+            }
+        }
+        if (!ready) {
+            int n;
+
+            for (int r = 0; r < ringCnt; r++) {
+                if (!rings[r].done) {
+                    gHdr = rings[r].hdr;
+                    StatAdd(&gHdr->consStats.sleeps, 1);
+                }
+            }
+            n = epoll_wait(epfd, events, ringCnt, -1);
+            for (int i = 0; i < n; i++) {
+                uint64_t cnt;
+                if (read(rings[events[i].data.u32].doorbell, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+                    perror("Doorbell read failed");
+                }
+            }
+        }
+        for (int r = 0; r < ringCnt; r++) {
+            if (!rings[r].done) {
+                atomic_fetch_sub(&rings[r].hdr->consumerSleeping, 1);
+            }
+        }
+    }
+
+    for (int r = 0; r < ringCnt; r++) {
+        items += rings[r].items;
+        DetachRing(&rings[r]);
+    }
+    close(epfd);
+    PrintSummary("Consumer", items, start);
+}
+#else
+// epoll is Linux-only
+void ServeRings(char** names, int ringCnt)
+{
+    (void)names;
+    (void)ringCnt;
+    printf("Consumer: Serving rings with -R needs Linux.\n");
+    exit(1);
+}
+#endif
+
+// Take the doorbell a producer started with -E serves for a ring, then map the ring
+void AttachRing(Ring* ring, const char* name)
+{
+    int shm_fd;
+
+    ring->name = name;
+    ring->doorbell = RecvDoorbell(name);
+    shm_fd = shm_open(name, O_RDWR, 0666);
+    if (shm_fd == -1) {
+        printf("Consumer: Failed to open ring %s.\n", name);
+        exit(1);
+    }
+    ring->hdr = MapRing(shm_fd);
+    if (ring->hdr->mpmc || ring->hdr->maxMsgLen > 0 || ring->hdr->persistent || ring->hdr->stampTimes) {
+        printf("Consumer: Ring %s is not a plain ring of ints, which is all -R serves.\n", name);
+        exit(1);
+    }
+    ring->out = atomic_load(&ring->hdr->out);
+    ring->done = 0;
+    ring->items = 0;
+    ring->valSum = 0;
+    printf("Consumer serving ring %s: bufSize = %d, itemCnt = %d\n", name,
+           ring->hdr->bufSize, ring->hdr->itemCnt);
+}
+
+// Consume up to a batch of items from one ring without waiting, and return how
+// many. The ring is marked done once its producer finished and it is drained.
+int DrainRing(Ring* ring)
+{
+    long valSum = gValSum;
+    unsigned int avail;
+    RingSpan span;
+
+    gHdr = ring->hdr; // MakeSpan, ConsumeFrom and WakeProducer work on gHdr
+    avail = GetIn() - ring->out;
+    if (avail == 0) {
+        // "in" is re-read after the flag so a final publish isn't missed
+        if (GetProducerDone() && GetIn() == ring->out) {
+            ring->done = 1;
+            printf("Ring %s: %ld items, value sum %ld\n", ring->name, ring->items, ring->valSum);
+        }
+        return 0;
+    }
+    RecordDepth(avail); // Not on empty polls, which the loop makes for every ring on each wakeup
+    if (avail > (unsigned int)gHdr->batchSize) {
+        avail = gHdr->batchSize;
+    }
+
+    span = MakeSpan(ring->out, avail);
+    ConsumeFrom(span.first, span.firstLen, ring->out);
+    ConsumeFrom(span.second, span.secondLen, ring->out + span.firstLen);
+
+    ring->out += avail;
+    SetOut(ring->out);
+    WakeProducer();
+    StatAdd(&gHdr->consStats.items, avail);
+    ring->items += avail;
+    ring->valSum += gValSum - valSum;
+    return avail;
+}
+
+// Unmap a served ring and remove it, since its producer has exited
+void DetachRing(Ring* ring)
+{
+    atomic_fetch_add(&ring->hdr->consumerDone, 1);
+    close(ring->doorbell);
+    munmap(ring->hdr, ring->hdr->shmSize);
+    if (shm_unlink(ring->name) == -1) {
+        printf("Error removing %s\n", ring->name);
+    }
+}
+
+// Connect to the producer serving a ring and receive its doorbell eventfd.
+// The producer may not be up yet, so keep trying for a while.
+int RecvDoorbell(const char* name)
+{
+    struct sockaddr_un addr;
+    socklen_t addrLen = GetDoorbellAddr(&addr, name);
+    char data;
+    struct iovec iov = { &data, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = { 0 };
+    struct cmsghdr* cmsg;
+    int fd = -1;
+    int sock;
+
+    for (int tries = 0; ; tries++) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock != -1 && connect(sock, (struct sockaddr*)&addr, addrLen) == 0) {
+            break;
+        }
+        if (sock != -1) {
+            close(sock);
+        }
+        if (tries == 1000) {
+            printf("Consumer: No producer is serving ring %s.\n", name);
+            exit(1);
+        }
+        usleep(10000);
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    if (recvmsg(sock, &msg, 0) == 1 && (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+        cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    close(sock);
+    if (fd == -1) {
+        printf("Consumer: Failed to receive the doorbell for ring %s.\n", name);
+        exit(1);
+    }
+    return fd;
+}
+
+// Address of the socket the doorbell for a ring is served on, in the abstract
+// namespace so nothing is left in the filesystem (must match producer.c)
+socklen_t GetDoorbellAddr(struct sockaddr_un* addr, const char* ringName)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "ringbell:%s", ringName);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+// Record "out" as durable and write the header to disk. Items consumed since
+// the last sync are delivered again if the consumer dies before the next one.
+void SyncConsumer()
+{
+    gHdr->durableOut = gOut;
+    if (msync(gHdr, sizeof(ShmHeader), MS_SYNC) == -1) {
+        perror("msync failed");
+    }
+    gSyncedOut = gOut;
+}
+
+// Reduce the stream to the product of its values mod NUM_LIMIT with workerCnt
+// threads, each draining whole batches straight from the ring, so the product
+// is ready as soon as the last item arrives. Returns the number of items read.
+int ConsumerReduce(int workerCnt)
+{
+    pthread_t tids[workerCnt];
+
+    atomic_init(&gClaim, gOut);
+    gReleased = gOut;
+    gDoneLen = calloc(gHdr->bufSize, sizeof(int));
+    gDoneProd = calloc(gHdr->bufSize, sizeof(long));
+    if (gDoneLen == NULL || gDoneProd == NULL) {
+        printf("Consumer: Failed to allocate the reduction table.\n");
+        exit(1);
+    }
+    for (int w = 0; w < workerCnt; w++) {
+        if (pthread_create(&tids[w], NULL, ReduceWorker, NULL) != 0) {
+            printf("Consumer: Failed to start reduction thread %d.\n", w);
+            exit(1);
+        }
+    }
+    for (int w = 0; w < workerCnt; w++) {
+        pthread_join(tids[w], NULL);
+    }
+    free(gDoneLen);
+    free(gDoneProd);
+    gOut = gReleased;
+    return (int)gOut;
+}
+
+// Claim a batch, reduce it in place in the ring, and release it
+void* ReduceWorker(void* arg)
+{
+    unsigned int pos;
+    int n;
+
+    (void)arg;
+    while ((n = ClaimBatch(&pos)) > 0) {
+        RingSpan span = MakeSpan(pos, n);
+        long sum = 0;
+        long prod = ReduceBatch(span.first, span.firstLen, &sum);
+        prod = prod * ReduceBatch(span.second, span.secondLen, &sum) % NUM_LIMIT;
+        ReleaseBatch(pos, n, prod, sum);
+    }
+    return NULL;
+}
+
+// Park a reduced batch, then fold every batch that is now next in stream
+// order into the product and hand its slots back to the producer. No worker
+// waits for a slower one; the last of a run of batches to finish releases them all.
+void ReleaseBatch(unsigned int pos, int n, long prod, long sum)
+{
+    unsigned int first;
+    int len;
+
+    pthread_mutex_lock(&gReleaseLock);
+    gDoneLen[pos & gHdr->mask] = n;
+    gDoneProd[pos & gHdr->mask] = prod;
+    gValSum += sum;
+
+    first = gReleased;
+    while ((len = gDoneLen[gReleased & gHdr->mask]) != 0) {
+        unsigned int indx = gReleased & gHdr->mask;
+        if (!gHdr->quiet) {
+            printf("Reduced items %u to %u: partial product %ld\n", gReleased, gReleased + len - 1,
+                   gDoneProd[indx]);
+        }
+        gProd = gProd * gDoneProd[indx] % NUM_LIMIT;
+        gDoneLen[indx] = 0;
+        gReleased += len;
+    }
+    if (gReleased != first) {
+        SetOut(gReleased);
+        WakeProducer();
+        StatAdd(&gHdr->consStats.items, gReleased - first);
+    }
+    pthread_mutex_unlock(&gReleaseLock);
+}
+
+// Take up to batchSize unclaimed items, waiting while there are none. Returns
+// how many, with the first one's index in pos, or 0 once the stream has ended.
+int ClaimBatch(unsigned int* pos)
+{
+    unsigned int claim = atomic_load(&gClaim);
+    unsigned int in;
+    unsigned int n;
+
+    do {
+        while ((in = GetIn()) == claim) {
+            // "in" is re-read after the flag so a final publish isn't missed
+            if (GetProducerDone() && GetIn() == claim) {
+                return 0;
+            }
+            WaitForItems(in);
+            claim = atomic_load(&gClaim);
+        }
+        n = in - claim;
+        if (n > (unsigned int)gHdr->batchSize) {
+            n = gHdr->batchSize;
+        }
+    } while (!atomic_compare_exchange_weak(&gClaim, &claim, claim + n));
+
+    *pos = claim;
+    return (int)n;
+}
+
+// Product mod NUM_LIMIT of len values, adding them to *sum too. Two values are
+// multiplied in before each reduction: both are under NUM_LIMIT, so the
+// running value stays below NUM_LIMIT^3, well inside 64 bits.
+long ReduceBatch(const int* vals, int len, long* sum)
+{
+    unsigned long prod = 1;
+    int k = 0;
+
+    for (; k + 1 < len; k += 2) {
+        unsigned long a = (unsigned long)(vals[k] % NUM_LIMIT + NUM_LIMIT) % NUM_LIMIT;
+        unsigned long b = (unsigned long)(vals[k + 1] % NUM_LIMIT + NUM_LIMIT) % NUM_LIMIT;
+        prod = prod * a * b % NUM_LIMIT;
+        *sum += (long)vals[k] + vals[k + 1];
+    }
+    if (k < len) {
+        prod = prod * (unsigned long)((vals[k] % NUM_LIMIT + NUM_LIMIT) % NUM_LIMIT) % NUM_LIMIT;
+        *sum += vals[k];
+    }
+    return (long)prod;
+}
+
+// Message mode: read records in place in shared memory and release each one
+void ConsumerMsg(int itemCnt) {
+    for (int i = 0; i < itemCnt; i++) {
+        int len;
+        const unsigned char* payload = PeekMsg(&len);
+        unsigned int checksum = 0;
+
+        if (payload == NULL) {
+            printf("No more items to consume, exiting.\n");
+            exit(0);
+        }
+
+        for (int k = 0; k < len; k++) {
+            checksum += payload[k];
+        }
+        int itemNum = ((const FrameHdr*)payload - 1)->itemNum;
+        int offset = (int)(payload - sizeof(FrameHdr) - (const unsigned char*)gHdr->buf);
+        if (!gHdr->quiet) {
+            printf("Consuming Message %d with %d bytes (checksum %u) at Offset %d\n", itemNum, len, checksum, offset);
+        }
+        if (gLogging) {
+            LogItem(itemNum, checksum, offset, len);
+        }
+        gValSum += checksum;
+        ReleaseMsg();
+    }
+}
+
+// MPMC mode: take items from the shared queue until every producer is done
+// and the queue is drained. Returns how many items this consumer took.
+int ConsumerMpmc(int consumerNum) {
+    int val;
+    int indx;
+    int cnt = 0;
+
+    while (MpmcDequeue(&val, &indx)) {
+        if (!gHdr->quiet) {
+            printf("Consumer %d consuming value %d at Index %d\n", consumerNum, val, indx);
+        }
+        if (gLogging) {
+            LogItem(cnt, val, indx, sizeof(int));
+        }
+        if (gHdr->stampTimes) {
+            RecordLatency(cnt, val);
+        }
+        gValSum += val;
+        cnt++;
+    }
+    return cnt;
+}
+
+// Take the next item from the MPMC queue, waiting while it is empty. Returns 0
+// once every producer is done and nothing is left.
+int MpmcDequeue(int* val, int* indx)
+{
+    MpmcSlot* slots = (MpmcSlot*)gHdr->buf;
+    unsigned int pos = atomic_load_explicit(&gHdr->out, memory_order_relaxed);
+    Backoff bo = {0};
+
+    for (;;) {
+        MpmcSlot* slot = &slots[pos & gHdr->mask];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - (pos + 1));
+
+        if (diff == 0) {
+            // Slot holds the item for this position: claim it, read it, free it
+            if (atomic_compare_exchange_weak_explicit(&gHdr->out, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *val = slot->val;
+                *indx = pos & gHdr->mask;
+                atomic_store_explicit(&slot->seq, pos + gHdr->mask + 1, memory_order_release);
+                atomic_thread_fence(memory_order_seq_cst);
+                if (atomic_load_explicit(&gHdr->producerSleeping, memory_order_relaxed)) {
+                    FutexWake(&slot->seq, INT_MAX);
+                }
+                StatAdd(&gHdr->consStats.items, 1);
+                return 1;
+            }
+            // Lost the race; pos now holds the current "out"
+        } else if (diff < 0) {
+            // Queue is empty. Every producer publishes before it counts itself
+            // done, so if they all are and the slot is still empty, we're finished.
+            if (GetProducerDone() && atomic_load_explicit(&slot->seq, memory_order_acquire) == seq) {
+                return 0;
+            }
+            MpmcBackoff(&bo, &slot->seq, seq);
+            pos = atomic_load_explicit(&gHdr->out, memory_order_relaxed);
+        } else {
+            // Another consumer already took this position
+            pos = atomic_load_explicit(&gHdr->out, memory_order_relaxed);
+        }
+    }
+}
+
+// One step of the spin, yield, sleep strategy while waiting for an MPMC slot
+// whose sequence number is still seen. Also stops waiting at end of stream.
+void MpmcBackoff(Backoff* bo, atomic_uint* seq, unsigned int seen)
+{
+    if (bo->start == 0) {
+        bo->start = GetMicroTime();
+        StatAdd(&gHdr->consStats.stalls, 1);
+    }
+
+    if (bo->yields == 0 && ((++bo->spins & 63) != 0 || GetMicroTime() - bo->start < gHdr->spinUsec)) {
+        CpuRelax();
+        StatAdd(&gHdr->consStats.spins, 1);
+    } else if (bo->yields < gHdr->yieldCnt) {
+        bo->yields++;
+        sched_yield();
+    } else {
+        StatAdd(&gHdr->consStats.sleeps, 1);
+        atomic_fetch_add(&gHdr->consumerSleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(seq) == seen && !GetProducerDone()) {
+            FutexWait(seq, seen);
+        }
+        atomic_fetch_sub(&gHdr->consumerSleeping, 1);
+    }
+}
+
+// Check if every producer has completed
+int GetProducerDone() {
+    return atomic_load_explicit(&gHdr->producerDone, memory_order_acquire) == gHdr->producerCnt;
+}
+
+// The consumer is the only writer of "out". The acquire load of "in" pairs with
+// the producer's release store, so the slot data is visible before the index moves.
+void SetOut(unsigned int val) { atomic_store_explicit(&gHdr->out, val, memory_order_release); }
+unsigned int GetIn() { return atomic_load_explicit(&gHdr->in, memory_order_acquire); }
+unsigned int GetOut() { return atomic_load_explicit(&gHdr->out, memory_order_relaxed); }
+
+int GetBufSize() { return gHdr->bufSize; }
+int GetItemCnt() { return gHdr->itemCnt; }
+
+// Consume len items numbered from itemNum on
+void ConsumeFrom(int* slots, int len, int itemNum)
+{
+    for (int k = 0; k < len; k++) {
+        int indx = (int)(slots + k - gHdr->buf);
+        if (!gHdr->quiet) {
+            printf("Consuming Item %d with value %d at Index %d\n", itemNum + k, slots[k], indx);
+        }
+        if (gLogging) {
+            LogItem(itemNum + k, slots[k], indx, sizeof(int));
+        }
+        if (gHdr->stampTimes) {
+            RecordLatency(itemNum + k, slots[k]);
+        }
+        gValSum += slots[k];
+    }
+}
+
+// Get up to n filled slots, waiting until at least one is available. Returns
+// an empty span once the producer is done and the buffer is drained. The shared
+// "in" is only re-read when the cached copy doesn't show n items.
+RingSpan PeekRead(int n)
+{
+    unsigned int avail = WaitForAvail(n);
+    return MakeSpan(gOut, avail < (unsigned int)n ? (int)avail : n);
+}
+
+// Refresh the cached "in" if it doesn't show at least want units past "out",
+// waiting while nothing at all is available. Returns what is available, which
+// is 0 only once the producer is done and the buffer is drained.
+unsigned int WaitForAvail(unsigned int want)
+{
+    unsigned int avail = gInCache - gOut;
+
+    if (avail < want) {
+        gInCache = GetIn();
+        RecordDepth(gInCache - gOut);
+        while ((avail = gInCache - gOut) == 0) {
+            // "in" is re-read after the flag so a final publish isn't missed
+            if (GetProducerDone()) {
+                gInCache = GetIn();
+                avail = gInCache - gOut;
+                break;
+            }
+            gInCache = WaitForItems(gInCache); // Wait until there is something to consume
+        }
+    }
+    return avail;
+}
+
+// Give n slots returned by PeekRead back to the producer
+void ReleaseRead(int n)
+{
+    gOut += n;
+    SetOut(gOut);
+    WakeProducer();
+    StatAdd(&gHdr->consStats.items, n);
+}
+
+// Get the next message in place in shared memory, waiting for one to arrive.
+// Returns NULL once the producer is done and the buffer is drained.
+const void* PeekMsg(int* len)
+{
+    unsigned int ringBytes = gHdr->bufSize * sizeof(int);
+    const unsigned char* data = (const unsigned char*)gHdr->buf;
+
+    if (WaitForAvail(1) == 0) {
+        return NULL;
+    }
+
+    unsigned int offset = gOut & (ringBytes - 1);
+    const FrameHdr* frame = (const FrameHdr*)(data + offset);
+
+    // Padding is always published together with the frame after it,
+    // so skip to offset 0 and let ReleaseMsg hand both back
+    gPendingFrame = 0;
+    if (frame->len == FRAME_PAD) {
+        gPendingFrame = ringBytes - offset;
+        frame = (const FrameHdr*)data;
+    }
+
+    *len = frame->len;
+    gPendingFrame += FrameSize(frame->len);
+    return frame + 1;
+}
+
+// Give the message returned by PeekMsg back to the producer
+void ReleaseMsg()
+{
+    gOut += gPendingFrame;
+    SetOut(gOut);
+    WakeProducer();
+    StatAdd(&gHdr->consStats.items, 1);
+}
+
+// Bump a statistics counter. Each side has a single writer outside MPMC mode,
+// so a plain load and store is enough there (must match producer.c).
+void StatAdd(atomic_ulong* cnt, unsigned long n)
+{
+    if (gHdr->mpmc || gHdr->reduceWorkers > 0) {
+        atomic_fetch_add_explicit(cnt, n, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(cnt, atomic_load_explicit(cnt, memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
+// Count the ring depth, in slots or in bytes in message mode, in the histogram
+void RecordDepth(unsigned int used)
+{
+    unsigned long cap = gHdr->maxMsgLen > 0 ? gHdr->bufSize * sizeof(int) : (unsigned long)gHdr->bufSize;
+    StatAdd(&gHdr->consStats.depthHist[used * (DEPTH_BUCKETS - 1UL) / cap], 1);
+}
+
+// Bytes taken by a record with a len-byte payload, header and alignment included
+unsigned int FrameSize(int len)
+{
+    return (sizeof(FrameHdr) + len + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+}
+
+// Describe n slots starting at the free-running index start
+RingSpan MakeSpan(unsigned int start, int n)
+{
+    RingSpan span;
+    int indx = start & gHdr->mask;
+    int tail = gHdr->bufSize - indx;
+
+    span.first = gHdr->buf + indx;
+    span.firstLen = n < tail ? n : tail;
+    span.second = gHdr->buf;
+    span.secondLen = n - span.firstLen;
+    return span;
+}
+
+// Wait until the producer moves "in" past the given value or finishes. Spins for
+// spinUsec, then yields yieldCnt times, then sleeps on the "in" futex word.
+unsigned int WaitForItems(unsigned int in)
+{
+    unsigned int crnt;
+    long start = GetMicroTime();
+    int spins = 0;
+    int yields = 0;
+
+    StatAdd(&gHdr->consStats.stalls, 1);
+    while ((crnt = GetIn()) == in && !GetProducerDone()) {
+        if (yields == 0 && (++spins & 63) != 0) {
+            CpuRelax();
+        } else if (yields == 0 && GetMicroTime() - start < gHdr->spinUsec) {
+            CpuRelax();
+        } else if (yields < gHdr->yieldCnt) {
+            yields++;
+            sched_yield();
+        } else {
+            // Announce the sleep, then re-check so a publish in between isn't missed
+            StatAdd(&gHdr->consStats.sleeps, 1);
+            atomic_fetch_add(&gHdr->consumerSleeping, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (GetIn() == in && !GetProducerDone()) {
+                FutexWait(&gHdr->in, in);
+            }
+            atomic_fetch_sub(&gHdr->consumerSleeping, 1);
+        }
+    }
+    StatAdd(&gHdr->consStats.spins, spins);
+    return crnt;
+}
+
+// Wake the producer if it went to sleep on a full buffer. The fence orders the
+// preceding release of the slot before the flag check (pairs with the producer).
+void WakeProducer()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&gHdr->producerSleeping, memory_order_relaxed)) {
+        FutexWake(&gHdr->out, 1);
+    }
+}
+
+#ifdef __linux__
+// Sleep while *addr still holds val. Not FUTEX_PRIVATE since the word is in shared memory.
+void FutexWait(atomic_uint* addr, unsigned int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+// Wake up to cnt processes sleeping on addr
+void FutexWake(atomic_uint* addr, int cnt)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, cnt, NULL, NULL, 0);
+}
+#else
+// No futex outside Linux: nap briefly and let the caller re-check
+void FutexWait(atomic_uint* addr, unsigned int val)
+{
+    if (atomic_load(addr) == val) {
+        usleep(100);
+    }
+}
+
+void FutexWake(atomic_uint* addr, int cnt)
+{
+    (void)addr;
+    (void)cnt;
+}
+#endif
+
+void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+long GetMicroTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Start the background writer for the binary event log at path
+void OpenEventLog(const char* path)
+{
+    gLog.fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (gLog.fd == -1) {
+        printf("Failed to open event log %s\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < LOG_BUF_CNT; i++) {
+        gLog.bufs[i] = malloc(LOG_BUF_EVENTS * sizeof(LogEvent));
+        if (gLog.bufs[i] == NULL) {
+            printf("Failed to allocate event log buffers\n");
+            exit(1);
+        }
+    }
+    gLog.head = 0;
+    gLog.tail = 0;
+    gLog.full = 0;
+    gLog.closing = 0;
+    gLog.fill[0] = 0;
+    pthread_mutex_init(&gLog.lock, NULL);
+    pthread_cond_init(&gLog.cond, NULL);
+    pthread_create(&gLog.thread, NULL, EventLogWriter, NULL);
+    gLogging = 1;
+}
+
+// Record one item. Only touches the current buffer except when it fills up.
+void LogItem(int itemNum, int val, int indx, int len)
+{
+    struct timespec ts;
+    LogEvent* ev = &gLog.bufs[gLog.head][gLog.fill[gLog.head]++];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->timeNs = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    ev->itemNum = itemNum;
+    ev->val = val;
+    ev->indx = indx;
+    ev->len = len;
+
+    if (gLog.fill[gLog.head] == LOG_BUF_EVENTS) {
+        HandOffLogBuf();
+    }
+}
+
+// Pass the current buffer to the writer thread and move on to the next one,
+// waiting only if the writer has fallen a whole LOG_BUF_CNT buffers behind
+void HandOffLogBuf()
+{
+    pthread_mutex_lock(&gLog.lock);
+    gLog.full++;
+    pthread_cond_broadcast(&gLog.cond);
+    while (gLog.full == LOG_BUF_CNT) {
+        pthread_cond_wait(&gLog.cond, &gLog.lock);
+    }
+    gLog.head = (gLog.head + 1) % LOG_BUF_CNT;
+    gLog.fill[gLog.head] = 0;
+    pthread_mutex_unlock(&gLog.lock);
+}
+
+// Background thread: write out full buffers in order until the log is closed
+void* EventLogWriter(void* param)
+{
+    (void)param;
+    pthread_mutex_lock(&gLog.lock);
+    for (;;) {
+        while (gLog.full == 0 && !gLog.closing) {
+            pthread_cond_wait(&gLog.cond, &gLog.lock);
+        }
+        if (gLog.full == 0) {
+            break;
+        }
+        int buf = gLog.tail;
+        pthread_mutex_unlock(&gLog.lock);
+
+        size_t size = gLog.fill[buf] * sizeof(LogEvent);
+        if (write(gLog.fd, gLog.bufs[buf], size) != (ssize_t)size) {
+            perror("Event log write failed");
+        }
+
+        pthread_mutex_lock(&gLog.lock);
+        gLog.tail = (gLog.tail + 1) % LOG_BUF_CNT;
+        gLog.full--;
+        pthread_cond_broadcast(&gLog.cond);
+    }
+    pthread_mutex_unlock(&gLog.lock);
+    return NULL;
+}
+
+// Flush what's left and stop the writer thread
+void CloseEventLog()
+{
+    if (!gLogging) {
+        return;
+    }
+    pthread_mutex_lock(&gLog.lock);
+    if (gLog.fill[gLog.head] > 0) {
+        gLog.full++;
+    }
+    gLog.closing = 1;
+    pthread_cond_broadcast(&gLog.cond);
+    pthread_mutex_unlock(&gLog.lock);
+
+    pthread_join(gLog.thread, NULL);
+    close(gLog.fd);
+    for (int i = 0; i < LOG_BUF_CNT; i++) {
+        free(gLog.bufs[i]);
+    }
+    gLogging = 0;
+}
+
+// Print the end-of-run statistics for one side
+void PrintSummary(const char* who, long items, long startUsec)
+{
+    double secs = (GetMicroTime() - startUsec) / 1e6;
+    printf("%s: %ld items in %.3f s (%.0f items/s), value sum %ld\n",
+           who, items, secs, secs > 0 ? items / secs : 0.0, gValSum);
+}
+
+// Allocate room for the latency samples of up to itemCnt items
+void InitLatency(int itemCnt)
+{
+    gLatencyStride = (itemCnt + MAX_LAT_SAMPLES - 1) / MAX_LAT_SAMPLES;
+    gLatency = malloc(((size_t)itemCnt / gLatencyStride + 1) * sizeof(unsigned int));
+    if (gLatency == NULL) {
+        printf("Consumer: Failed to allocate latency samples.\n");
+        exit(1);
+    }
+}
+
+// Record the latency of item itemNum, whose value is its send time (low 32 bits, ns)
+void RecordLatency(long itemNum, int sentNs)
+{
+    struct timespec ts;
+
+    if (itemNum % gLatencyStride != 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    gLatency[gLatencyCnt++] = (unsigned int)(ts.tv_sec * 1000000000L + ts.tv_nsec) - (unsigned int)sentNs;
+}
+
+// Print p50/p99/p99.9/max of the recorded one-way latencies
+void PrintLatency(const char* who)
+{
+    if (gLatencyCnt == 0) {
+        return;
+    }
+    qsort(gLatency, gLatencyCnt, sizeof(unsigned int), CompareUint);
+    printf("%s latency: p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns (%ld samples)\n", who,
+           gLatency[gLatencyCnt * 50 / 100], gLatency[gLatencyCnt * 99 / 100],
+           gLatency[gLatencyCnt * 999 / 1000], gLatency[gLatencyCnt - 1], gLatencyCnt);
+}
+
+int CompareUint(const void* a, const void* b)
+{
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return (x > y) - (x < y);
+}
+
+// Pin the calling process to one CPU
+void PinToCpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        printf("Failed to pin to CPU %d\n", cpu);
+        exit(1);
+    }
+#else
+    (void)cpu;
+    printf("CPU pinning is not supported on this OS\n");
+#endif
+}
+
+// Print where this process is running: CPU, NUMA node, package and core
+void ReportPlacement(const char* who)
+{
+#ifdef __linux__
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    int package;
+    int core;
+
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    package = ReadCpuTopology(cpu, "physical_package_id");
+    core = ReadCpuTopology(cpu, "core_id");
+    printf("%s on CPU %u (node %u, package %d, core %d)\n", who, cpu, node, package, core);
+#else
+    printf("%s placement unknown on this OS\n", who);
+#endif
+}
+
+// Read one value from /sys/devices/system/cpu/cpuN/topology, -1 if missing
+int ReadCpuTopology(unsigned int cpu, const char* field)
+{
+    char path[128];
+    int val = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, field);
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%d", &val) != 1) {
+            val = -1;
+        }
+        fclose(f);
+    }
+    return val;
+}
@@ -7,6 +7,8 @@ Section 01
 OSs Tested on: Mac
 */
 
+#define _GNU_SOURCE // For sched_setaffinity and the CPU_SET macros
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,28 +18,319 @@ OSs Tested on: Mac
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
+
+// Largest buffer size accepted (items); the buffer size is rounded up to a power of two
+#define MAX_BUF_SIZE (1 << 28)
+
+// Segment size granularity when the ring is backed by huge pages
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Cache line size, used to keep the producer's and consumer's indices apart
+#define CACHE_LINE 64
+
+// Default wait strategy: spin this long, then yield this many times, then sleep
+#define DEFAULT_SPIN_USEC 50
+#define DEFAULT_YIELD_CNT 16
+
+// Default number of items reserved/committed at a time
+#define DEFAULT_BATCH_SIZE 16
+
+// Events per event-log buffer, and buffers in flight to the writer thread
+#define LOG_BUF_EVENTS 65536
+#define LOG_BUF_CNT 4
+
+// Longest event log path prefix kept in the header
+#define LOG_PATH_LEN 128
+
+// Most CPUs accepted in a -p/-c pinning list
+#define MAX_PIN_CPUS 64
+
+// Identifies a ring header, and its layout version (must match consumer.c)
+#define RING_MAGIC 0x52494E47
+#define RING_VERSION 3
+
+// Default items between msyncs of a persistent ring (-f)
+#define DEFAULT_SYNC_INTERVAL 4096
+
+// Queue depth histogram buckets: fill level in eighths of the ring, 0/8 to 8/8
+#define DEPTH_BUCKETS 9
+
+// Modulus of the product the consumer computes with -W (as in Assignment-2)
+#define NUM_LIMIT 9973
+
+// Most consumer reduction threads
+#define MAX_REDUCE_WORKERS 64
+
+// xoshiro128** lanes stepped together, and values generated per refill
+#define XO_LANES 8
+#define XO_BATCH 1024
+
+// Records in message mode start on this boundary
+#define FRAME_ALIGN 8
+
+// Frame length that marks the rest of the buffer as padding
+#define FRAME_PAD 0xFFFFFFFFu
+
+// Counters for one side of the ring, on their own cache lines. Only that side
+// writes them; ringstat reads them while the ring runs.
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ulong items; // Items moved
+    atomic_ulong stalls; // Waits on a full (producer) or empty (consumer) ring
+    atomic_ulong spins; // Busy-wait iterations while stalled
+    atomic_ulong sleeps; // Times the side went to sleep while stalled
+    atomic_ulong depthHist[DEPTH_BUCKETS]; // Depth seen each time the other index is re-read
+} SideStats;
+
+// Layout of the shared memory header (must match consumer.c).
+// "in" and "out" are free-running item counts; the slot is the count masked
+// with bufSize - 1 (bufSize is a power of two). The producer only writes "in" and the consumer only writes "out",
+// and each sits on its own cache line so the two cores don't fight over one line.
+// A side that runs out of spinning sleeps on the other side's index as a futex
+// word and bumps its "Sleeping" count, which lives on the line the other side
+// already owns, so the waker only pays for a wake-up when someone is asleep.
+// producerDone counts finished producers; the stream ends when it reaches producerCnt.
+typedef struct {
+    unsigned int magic; // RING_MAGIC
+    unsigned int version; // RING_VERSION
+    size_t shmSize; // Size of the whole segment, so the consumer can map it
+    int hugePages;
+    int bufSize;
+    unsigned int mask;
+    int itemCnt;
+    int spinUsec;
+    int yieldCnt;
+    int batchSize;
+    int maxMsgLen; // Non-zero in message mode
+    int mpmc; // Non-zero when the buffer holds MpmcSlots
+    int producerCnt;
+    int consumerCnt;
+    int quiet; // Skip per-item output
+    int stampTimes; // Item values are send times, for latency measurement
+    char logPath[LOG_PATH_LEN]; // Event log path prefix, empty for none
+    int consumerCpus[MAX_PIN_CPUS]; // Consumer N pins itself to consumerCpus[N % consumerCpuCnt]
+    int consumerCpuCnt;
+    int persistent; // Ring lives in a file and survives restarts
+    int syncInterval; // Items between msyncs in persistent mode
+    int reduceWorkers; // Consumer threads computing the product mod NUM_LIMIT, 0 for none
+    atomic_int producerDone;
+    atomic_int consumerDone;
+    _Alignas(CACHE_LINE) atomic_uint in;
+    atomic_int consumerSleeping;
+    _Alignas(CACHE_LINE) atomic_uint out;
+    atomic_int producerSleeping;
+    // Last "in"/"out" known to be on disk in persistent mode; a restart resumes from here
+    _Alignas(CACHE_LINE) unsigned int durableIn;
+    unsigned int durableOut;
+    SideStats prodStats;
+    SideStats consStats;
+    _Alignas(CACHE_LINE) int buf[]; // The bounded buffer itself
+} ShmHeader;
+
+// A run of buffer slots, split in two when it wraps past the end of the buffer
+typedef struct {
+    int* first;
+    int firstLen;
+    int* second;
+    int secondLen;
+} RingSpan;
+
+// Start of every record in message mode (must match consumer.c). In this mode
+// "in" and "out" count bytes and the buffer is bufSize * sizeof(int) bytes.
+// Records start on FRAME_ALIGN boundaries and never wrap: when one doesn't fit
+// before the end of the buffer the producer writes a FRAME_PAD marker and
+// starts the record over at offset 0.
+typedef struct {
+    unsigned int len; // Payload bytes following the header
+    int itemNum;
+} FrameHdr;
+
+// Buffer slot in MPMC mode (must match consumer.c). This is a bounded queue
+// with a sequence number per slot (Vyukov): a slot at position pos is free
+// for a producer when seq == pos and holds an item for a consumer when
+// seq == pos + 1. "in" and "out" are the next positions to claim with a CAS.
+// Waiters sleep on the seq word of the slot they are waiting for.
+typedef struct {
+    atomic_uint seq;
+    int val;
+} MpmcSlot;
+
+// One record in the binary event log (-L). The producer and consumer each
+// write their own file of these, in the order they moved the items.
+typedef struct {
+    long timeNs; // CLOCK_MONOTONIC
+    int itemNum;
+    int val; // Item value, or the payload checksum in message mode
+    int indx; // Slot index, or the frame offset in message mode
+    int len; // Payload bytes
+} LogEvent;
+
+// Binary event log. The hot path fills bufs[head]; full buffers are written
+// by a background thread so the producer/consumer never block on the file
+// unless the writer falls LOG_BUF_CNT buffers behind.
+typedef struct {
+    LogEvent* bufs[LOG_BUF_CNT];
+    int fill[LOG_BUF_CNT];
+    int head; // Buffer being filled
+    int tail; // Next buffer to write out
+    int full; // Buffers waiting for the writer
+    int closing;
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} EventLog;
+
+// Where int item values come from (-g). open runs once in main, seed at the
+// start of each producer, and fill writes up to n values and returns how many,
+// which is less than n only once the input is used up.
+typedef struct {
+    const char* name;
+    void (*open)(const char*);
+    void (*seed)(int);
+    int (*fill)(int*, int);
+} PayloadSource;
+
+// xoshiro128** state, XO_LANES generators side by side so each step is a few
+// vector instructions (GCC/Clang vector extensions, any target)
+typedef uint32_t XoVec __attribute__((vector_size(XO_LANES * sizeof(uint32_t))));
 
-// Size of shared memory block
-#define SHM_SIZE 4096
+// Progress of one spin-then-yield-then-sleep wait
+typedef struct {
+    long start;
+    int spins;
+    int yields;
+} Backoff;
 
 // Global pointer to the shared memory block
 void* gShmPtr;
+ShmHeader* gHdr;
 
-void Producer(int, int, int);
+// Event log and end-of-run statistics for this process
+EventLog gLog;
+int gLogging = 0;
+long gValSum = 0;
+
+// Producer-side ring state: our own index and a cached copy of the consumer's
+unsigned int gIn;
+unsigned int gOutCache;
+unsigned int gPendingFrame; // Bytes reserved by ReserveMsg, published by CommitMsg
+unsigned int gSyncedIn; // "in" as of the last msync in persistent mode
+
+// Settings from the command line, copied into the header for the consumer
+int gSpinUsec = DEFAULT_SPIN_USEC;
+int gYieldCnt = DEFAULT_YIELD_CNT;
+int gBatchSize = DEFAULT_BATCH_SIZE;
+int gHugePages = 0;
+int gMaxMsgLen = 0;
+int gMpmc = 0;
+int gProducerCnt = 1;
+int gConsumerCnt = 1;
+int gQuiet = 0;
+int gStampTimes = 0;
+int gProducerCpus[MAX_PIN_CPUS]; // Producer N pins itself to gProducerCpus[N % gProducerCpuCnt]
+int gProducerCpuCnt = 0;
+int gConsumerCpus[MAX_PIN_CPUS];
+int gConsumerCpuCnt = 0;
+int gNumaNode = -1; // NUMA node for the ring memory, -1 for first touch
+char* gRingFile = NULL; // Backing file for a persistent ring
+char* gRingName = "OS_HW1_ryanSario"; // Shared memory name of the ring
+int gExternal = 0; // The consumer is a separate event loop, woken through gDoorbell
+int gDoorbell = -1; // eventfd the consumer waits on in its epoll set, -1 for futex wakes
+int gSyncInterval = DEFAULT_SYNC_INTERVAL;
+int gReduceWorkers = 0;
+long gProd = 1; // Product of the values mod NUM_LIMIT, to check the consumer's with -W
+const PayloadSource* gSource; // Set from -g, libc rand() by default
+long gSourceCnt = -1; // Values the source holds, -1 if unknown
+
+// Payload source state
+XoVec gXo[4];
+int gXoBuf[XO_BATCH];
+int gXoPos = XO_BATCH;
+const int* gFileVals; // mmap'd file of native-endian ints
+long gFilePos;
+char* gLogPath = NULL;
+
+int Producer(int, int);
+void ProducerMsg(int, int);
+void ProducerMpmc(int, int, int);
+void LaunchMpmc(int, int);
 void InitShm(int, int);
+size_t GetShmSize(int);
+int RoundUpPow2(int);
 void SetBufSize(int);
 void SetItemCnt(int);
-void SetIn(int);
-void SetOut(int);
-void SetHeaderVal(int, int);
+void SetIn(unsigned int);
+void SetOut(unsigned int);
+void MarkProducerDone();
 int GetBufSize();
 int GetItemCnt();
-int GetIn();
-int GetOut();
-int GetHeaderVal(int);
-void WriteAtBufIndex(int, int);
-int ReadAtBufIndex(int);
+unsigned int GetIn();
+unsigned int GetOut();
+RingSpan ReserveWrite(int);
+void CommitWrite(int);
+void SyncProducer();
+void StatAdd(atomic_ulong*, unsigned long);
+void RecordDepth(unsigned int);
+void SyncRange(void*, size_t);
+int ListenDoorbell();
+void ServeDoorbell(int);
+socklen_t GetDoorbellAddr(struct sockaddr_un*, const char*);
+RingSpan MakeSpan(unsigned int, int);
+int ProduceInto(int*, int, int);
+void* ReserveMsg(int);
+void CommitMsg();
+unsigned int FrameSize(int);
+int MpmcEnqueue(int);
+void MpmcBackoff(Backoff*, atomic_uint*, unsigned int);
 int GetRand(int, int);
+int NextVal();
+void OpenSource(const char*);
+void SkipVals(unsigned int);
+void RandSeed(int);
+int RandFill(int*, int);
+void XoshiroSeed(int);
+int XoshiroFill(int*, int);
+void XoshiroRefill();
+uint64_t SplitMix64(uint64_t*);
+void FileOpen(const char*);
+int FileFill(int*, int);
+int StdinFill(int*, int);
+void NoOpen(const char*);
+void NoSeed(int);
+unsigned int WaitForSpace(unsigned int);
+void WakeConsumer();
+void FutexWait(atomic_uint*, unsigned int);
+void FutexWake(atomic_uint*, int);
+void OpenEventLog(const char*);
+void LogItem(int, int, int, int);
+void HandOffLogBuf();
+void* EventLogWriter(void*);
+void CloseEventLog();
+void PrintSummary(const char*, long, long);
+int ParseCpuList(const char*, int*);
+void BindToNode(void*, size_t, int);
+void PlaceProducer(int);
+void PinToCpu(int);
+void ReportPlacement(const char*);
+int ReadCpuTopology(unsigned int, const char*);
+void CpuRelax();
+long GetMicroTime();
 
 int main(int argc, char* argv[])
 {
@@ -45,29 +338,192 @@ int main(int argc, char* argv[])
     int bufSize; 
     int itemCnt; 
     int randSeed;
+    int opt;
+
+    // Options: -s <usec> to spin before yielding, -y <count> yields before sleeping,
+    // -b <count> items moved per reserve/commit, -H to back the ring with huge pages,
+    // -m <bytes> to send variable-length messages of up to that size instead of ints,
+    // -P <count> / -C <count> producer and consumer processes sharing one MPMC queue,
+    // -q to print only summary statistics, -L <path> to write binary event logs,
+    // -T to send timestamps as the item values so the consumer reports latency,
+    // -p <cpus> / -c <cpus> to pin producers / consumers (e.g. "2,4,6"),
+    // -N <node> to bind the ring memory to a NUMA node,
+    // -f <file> to keep the ring in a file that survives restarts, msynced every -S <items>,
+    // -n <name> to name the ring, -E to serve it to a separately started "consumer -R",
+    // -g <source> for the item values: rand (libc, the default), xoshiro, file:<path>
+    // (raw native-endian ints, mmap'd) or stdin (the same, streamed),
+    // -W <threads> to have the consumer reduce the stream to its product mod NUM_LIMIT
+    const char* sourceSpec = NULL;
+    while ((opt = getopt(argc, argv, "s:y:b:Hm:P:C:qL:Tp:c:N:f:S:n:Eg:W:")) != -1) {
+        switch (opt) {
+        case 's': gSpinUsec = atoi(optarg); break;
+        case 'y': gYieldCnt = atoi(optarg); break;
+        case 'b': gBatchSize = atoi(optarg); break;
+        case 'H': gHugePages = 1; break;
+        case 'm': gMaxMsgLen = atoi(optarg); break;
+        case 'P': gProducerCnt = atoi(optarg); gMpmc = 1; break;
+        case 'C': gConsumerCnt = atoi(optarg); gMpmc = 1; break;
+        case 'q': gQuiet = 1; break;
+        case 'L': gLogPath = optarg; break;
+        case 'T': gStampTimes = 1; break;
+        case 'p': gProducerCpuCnt = ParseCpuList(optarg, gProducerCpus); break;
+        case 'c': gConsumerCpuCnt = ParseCpuList(optarg, gConsumerCpus); break;
+        case 'N': gNumaNode = atoi(optarg); break;
+        case 'f': gRingFile = optarg; break;
+        case 'S': gSyncInterval = atoi(optarg); break;
+        case 'n': gRingName = optarg; break;
+        case 'E': gExternal = 1; break;
+        case 'g': sourceSpec = optarg; break;
+        case 'W': gReduceWorkers = atoi(optarg); break;
+        default:
+            printf("Usage: %s [-s spinUsec] [-y yieldCnt] [-b batchSize] [-H] [-m maxMsgLen] "
+                   "[-P producerCnt] [-C consumerCnt] [-q] [-L logPath] [-T] "
+                   "[-p cpuList] [-c cpuList] [-N numaNode] [-f ringFile] [-S syncInterval] "
+                   "[-n ringName] [-E] [-g source] [-W reduceWorkers] bufSize itemCnt randSeed\n", argv[0]);
+            exit(1);
+        }
+    }
 
-    if (argc != 4) {
+    if (argc - optind != 3) {
         printf("Invalid number of command-line arguments\n");
         exit(1);
     }
 
-    bufSize = atoi(argv[1]);
-    itemCnt = atoi(argv[2]);
-    randSeed = atoi(argv[3]);
+    bufSize = atoi(argv[optind]);
+    itemCnt = atoi(argv[optind + 1]);
+    randSeed = atoi(argv[optind + 2]);
 
-    if (bufSize < 2 || bufSize > 480) {
-        printf("Invalid buffer size. Must be between 2 and 480.\n");
+    if (bufSize < 2 || bufSize > MAX_BUF_SIZE) {
+        printf("Invalid buffer size. Must be between 2 and %d.\n", MAX_BUF_SIZE);
         exit(1);
     }
 
+    // Power-of-two capacity so wrapping an index is a mask instead of a division
+    if (RoundUpPow2(bufSize) != bufSize) {
+        printf("Rounding buffer size %d up to %d\n", bufSize, RoundUpPow2(bufSize));
+        bufSize = RoundUpPow2(bufSize);
+    }
+
     if (itemCnt <= 0) {
         printf("Invalid item count. Must be greater than 0.\n");
         exit(1);
     }
 
-    srand(randSeed);
+    if (gSpinUsec < 0 || gYieldCnt < 0) {
+        printf("Invalid wait settings. Spin time and yield count must be >= 0.\n");
+        exit(1);
+    }
+
+    if (gBatchSize <= 0) {
+        printf("Invalid batch size. Must be greater than 0.\n");
+        exit(1);
+    }
+
+    // A frame plus the padding in front of it must always fit in an empty buffer
+    if (gMaxMsgLen < 0 || (gMaxMsgLen > 0 && FrameSize(gMaxMsgLen) > bufSize * sizeof(int) / 2)) {
+        printf("Invalid message size. Frames must fit in half the buffer (%d bytes).\n",
+               (int)(bufSize * sizeof(int) / 2));
+        exit(1);
+    }
+
+    if (gProducerCnt <= 0 || gConsumerCnt <= 0) {
+        printf("Invalid process count. Need at least one producer and one consumer.\n");
+        exit(1);
+    }
+
+    if (gLogPath != NULL && strlen(gLogPath) + 16 > LOG_PATH_LEN) {
+        printf("Invalid event log path. Must be shorter than %d characters.\n", LOG_PATH_LEN - 16);
+        exit(1);
+    }
+
+    if (gStampTimes && gMaxMsgLen > 0) {
+        printf("Timestamped items are not supported in message mode.\n");
+        exit(1);
+    }
+
+    if (gMpmc && gMaxMsgLen > 0) {
+        printf("Message mode only supports a single producer and consumer.\n");
+        exit(1);
+    }
+
+    if (gRingFile != NULL && (gMpmc || gMaxMsgLen > 0)) {
+        printf("Persistent rings only support a single producer and consumer of ints.\n");
+        exit(1);
+    }
+
+    if (gSyncInterval <= 0) {
+        printf("Invalid sync interval. Must be greater than 0.\n");
+        exit(1);
+    }
+
+    if (gExternal && (gMpmc || gMaxMsgLen > 0 || gRingFile != NULL)) {
+        printf("External consumers only support a single in-memory ring of ints.\n");
+        exit(1);
+    }
+
+    if (strlen(gRingName) + 16 > sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        printf("Invalid ring name. Must be shorter than %d characters.\n",
+               (int)sizeof(((struct sockaddr_un*)0)->sun_path) - 16);
+        exit(1);
+    }
+
+    if (sourceSpec != NULL && (gMaxMsgLen > 0 || gStampTimes)) {
+        printf("-g sets int item values, so it can't be combined with -m or -T.\n");
+        exit(1);
+    }
+
+    if (gReduceWorkers < 0 || gReduceWorkers > MAX_REDUCE_WORKERS) {
+        printf("Invalid reduction thread count. Must be between 0 and %d.\n", MAX_REDUCE_WORKERS);
+        exit(1);
+    }
+
+    if (gReduceWorkers > 0 && (gMpmc || gMaxMsgLen > 0 || gStampTimes || gLogPath != NULL ||
+                               gRingFile != NULL || gExternal)) {
+        printf("The reducing consumer (-W) only works on a plain single-producer ring of ints.\n");
+        exit(1);
+    }
+
+    OpenSource(sourceSpec != NULL ? sourceSpec : "rand");
+    if (gSource->fill == StdinFill && gMpmc) {
+        printf("stdin can only feed a single producer outside MPMC mode.\n");
+        exit(1);
+    }
+    if (gSource->fill == FileFill && gProducerCnt > 1) {
+        printf("A file can only feed a single producer.\n");
+        exit(1);
+    }
+    if (gSourceCnt >= 0 && gSourceCnt < itemCnt) {
+        printf("Source holds %ld items, producing that many\n", gSourceCnt);
+        itemCnt = (int)gSourceCnt;
+        if (itemCnt == 0) {
+            printf("Nothing to produce.\n");
+            exit(1);
+        }
+    }
+
+    // Claim the ring name before touching the segment, so a second producer
+    // can't reset a ring that is in use
+    int srv = gExternal ? ListenDoorbell() : -1;
+
     InitShm(bufSize, itemCnt);
 
+    if (gExternal) {
+        // No child to launch: hand the doorbell to the consumer event loop and produce
+        long start = GetMicroTime();
+
+        ServeDoorbell(srv);
+        printf("Starting Producer\n");
+        PlaceProducer(0);
+        PrintSummary("Producer", Producer(itemCnt, randSeed), start);
+        return 0;
+    }
+
+    if (gMpmc) {
+        LaunchMpmc(itemCnt, randSeed);
+        return 0;
+    }
+
+    fflush(stdout); // Don't let the child inherit unflushed output
     pid = fork();
 
     if (pid < 0) {
@@ -75,10 +531,33 @@ int main(int argc, char* argv[])
         exit(1);
     } else if (pid == 0) {
         printf("Launching Consumer \n");
-        execlp("./consumer", "consumer", NULL);
+        if (gRingFile != NULL) {
+            execlp("./consumer", "consumer", "-f", gRingFile, NULL);
+        } else {
+            execlp("./consumer", "consumer", "-n", gRingName, NULL);
+        }
     } else {
+        char logName[LOG_PATH_LEN];
+        long start = GetMicroTime();
+        unsigned int first = GetIn(); // Non-zero when resuming a persistent ring
+        int last = itemCnt;
+
         printf("Starting Producer\n");
-        Producer(bufSize, itemCnt, randSeed);
+        PlaceProducer(0);
+        if (gLogPath != NULL) {
+            snprintf(logName, sizeof(logName), "%s.prod0", gLogPath);
+            OpenEventLog(logName);
+        }
+        if (gMaxMsgLen > 0) {
+            ProducerMsg(itemCnt, randSeed);
+        } else {
+            last = Producer(itemCnt, randSeed);
+        }
+        PrintSummary("Producer", last - first, start);
+        if (gReduceWorkers > 0) {
+            printf("Producer product mod %d = %ld\n", NUM_LIMIT, gProd);
+        }
+        CloseEventLog();
         printf("Producer done and waiting for consumer\n");
         wait(NULL);
         printf("Consumer Completed\n");
@@ -89,88 +568,592 @@ int main(int argc, char* argv[])
 
 void InitShm(int bufSize, int itemCnt)
 {
-    int in = 0;
-    int out = 0;
-    const char *name = "OS_HW1_ryanSario";
+    const char *name = gRingName;
+    size_t shmSize = GetShmSize(bufSize);
+    int recover = 0;
+    int shm_fd;
 
-    int shm_fd = shm_open(name, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        printf("Failed to create shared memory block.\n");
-        exit(1);
+    if (gRingFile != NULL) {
+        struct stat st;
+
+        // An existing ring file is recovered instead of reset
+        shm_fd = open(gRingFile, O_CREAT | O_RDWR, 0666);
+        if (shm_fd == -1 || fstat(shm_fd, &st) == -1) {
+            printf("Failed to open ring file %s.\n", gRingFile);
+            exit(1);
+        }
+        recover = st.st_size > 0;
+        if (recover && (size_t)st.st_size != shmSize) {
+            printf("Ring file %s was made with a different buffer size.\n", gRingFile);
+            exit(1);
+        }
+    } else {
+        shm_fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+        if (shm_fd == -1) {
+            printf("Failed to create shared memory block.\n");
+            exit(1);
+        }
     }
 
-    ftruncate(shm_fd, SHM_SIZE);
-    gShmPtr = mmap(0, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (ftruncate(shm_fd, shmSize) == -1) {
+        printf("Failed to size shared memory block.\n");
+        exit(1);
+    }
+    gShmPtr = mmap(0, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     if (gShmPtr == MAP_FAILED) {
         printf("Failed to map shared memory.\n");
         exit(1);
     }
+    close(shm_fd);
 
+    // Set the memory policy before anything touches the pages
+    if (gNumaNode >= 0) {
+        BindToNode(gShmPtr, shmSize, gNumaNode);
+        printf("Ring memory bound to NUMA node %d\n", gNumaNode);
+    } else if (gMpmc) {
+        // The slots' sequence numbers are set below, before any producer is forked and pinned
+        printf("Ring memory placed on first touch by the launching process, before producers are pinned "
+               "(-N binds it to a node)\n");
+    } else {
+        // The header is set below, before PlaceProducer pins this process
+        printf("Ring buffer placed on first touch by the producer once pinned, the header before pinning\n");
+    }
+
+#ifdef MADV_HUGEPAGE
+    // Ask for transparent huge pages on the shmem mapping (needs shmem_enabled
+    // set to "advise" or "within_size" under /sys/kernel/mm/transparent_hugepage)
+    if (gHugePages && madvise(gShmPtr, shmSize, MADV_HUGEPAGE) == -1) {
+        printf("Huge pages not available, using regular pages.\n");
+    }
+#endif
+    gHdr = (ShmHeader*)gShmPtr;
+
+    unsigned int startIn = 0;
+    unsigned int startOut = 0;
+    if (recover) {
+        if (gHdr->magic != RING_MAGIC || gHdr->version != RING_VERSION) {
+            printf("Ring file %s is not a version %d ring.\n", gRingFile, RING_VERSION);
+            exit(1);
+        }
+        // The file size is rounded up to a page, so it can't tell apart rings
+        // the old slots would be misread by
+        if (gHdr->bufSize != bufSize || gHdr->mask != (unsigned int)bufSize - 1 || gHdr->mpmc != gMpmc ||
+            gHdr->maxMsgLen != gMaxMsgLen || gHdr->hugePages != gHugePages) {
+            printf("Ring file %s was made with bufSize %d%s%s%s, not this configuration.\n", gRingFile,
+                   gHdr->bufSize, gHdr->mpmc ? ", MPMC" : "", gHdr->maxMsgLen > 0 ? ", message mode" : "",
+                   gHdr->hugePages ? ", huge pages" : "");
+            exit(1);
+        }
+        // Resume from what was last synced. Items after durableOut may be
+        // consumed again, but none are lost. A finished run starts over.
+        startIn = gHdr->durableIn;
+        startOut = gHdr->durableOut < startIn ? gHdr->durableOut : startIn;
+        if (startIn == (unsigned int)gHdr->itemCnt && startOut == startIn) {
+            printf("Ring file %s holds a finished run, starting over\n", gRingFile);
+            startIn = 0;
+            startOut = 0;
+        } else if (startIn > (unsigned int)itemCnt) {
+            printf("Ring file %s already holds %u items. Item count must be at least that.\n", gRingFile, startIn);
+            exit(1);
+        } else {
+            // The producer reuses a slot as soon as the live "out" passes it,
+            // not durableOut, so anything a whole ring older than the newest
+            // item written has been overwritten and can't be replayed
+            unsigned int newest = atomic_load(&gHdr->in) > startIn ? atomic_load(&gHdr->in) : startIn;
+            if (newest - startOut > (unsigned int)bufSize) {
+                unsigned int kept = newest - bufSize < startIn ? newest - bufSize : startIn;
+                printf("Ring file %s: items %u to %u were overwritten before the consumer synced, %u items lost\n",
+                       gRingFile, startOut, kept - 1, kept - startOut);
+                startOut = kept;
+            }
+            printf("Recovered ring file %s: producer resumes at item %u, consumer at item %u\n",
+                   gRingFile, startIn, startOut);
+        }
+    }
+
+    gHdr->magic = RING_MAGIC;
+    gHdr->version = RING_VERSION;
+    gHdr->shmSize = shmSize;
+    gHdr->hugePages = gHugePages;
+    gHdr->mask = bufSize - 1;
     SetBufSize(bufSize);
     SetItemCnt(itemCnt);
-    SetIn(in);
-    SetOut(out);
+    gHdr->spinUsec = gSpinUsec;
+    gHdr->yieldCnt = gYieldCnt;
+    gHdr->batchSize = gBatchSize;
+    gHdr->maxMsgLen = gMaxMsgLen;
+    gHdr->mpmc = gMpmc;
+    gHdr->producerCnt = gProducerCnt;
+    gHdr->consumerCnt = gConsumerCnt;
+    gHdr->quiet = gQuiet;
+    gHdr->stampTimes = gStampTimes;
+    memcpy(gHdr->consumerCpus, gConsumerCpus, sizeof(gConsumerCpus));
+    gHdr->consumerCpuCnt = gConsumerCpuCnt;
+    gHdr->persistent = gRingFile != NULL;
+    gHdr->syncInterval = gSyncInterval;
+    gHdr->reduceWorkers = gReduceWorkers;
+    gHdr->durableIn = startIn;
+    gHdr->durableOut = startOut;
+    snprintf(gHdr->logPath, LOG_PATH_LEN, "%s", gLogPath != NULL ? gLogPath : "");
+    atomic_init(&gHdr->consumerDone, 0);
+    atomic_init(&gHdr->producerDone, 0);
+    memset(&gHdr->prodStats, 0, sizeof(SideStats));
+    memset(&gHdr->consStats, 0, sizeof(SideStats));
+    atomic_init(&gHdr->in, startIn);
+    atomic_init(&gHdr->out, startOut);
+    atomic_init(&gHdr->consumerSleeping, 0);
+    atomic_init(&gHdr->producerSleeping, 0);
+
+    if (gMpmc) {
+        MpmcSlot* slots = (MpmcSlot*)gHdr->buf;
+        for (int i = 0; i < bufSize; i++) {
+            atomic_init(&slots[i].seq, i);
+        }
+    }
 }
 
-void Producer(int bufSize, int itemCnt, int randSeed) {
-    int in = 0;
-    int out = 0;
+// Returns the number of the item after the last one produced, which is
+// itemCnt unless the payload source ran dry first.
+int Producer(int itemCnt, int randSeed) {
+    int i;
+
+    gSource->seed(randSeed);
+    gIn = GetIn();
+    gOutCache = GetOut();
+    gSyncedIn = gIn;
 
+    // When resuming a persistent ring, skip the values already produced so
+    // the stream is the same as an uninterrupted run
+    if (!gStampTimes) {
+        SkipVals(gIn);
+    }
+
+    for (i = gIn; i < itemCnt; ) {
+        int n = itemCnt - i < gBatchSize ? itemCnt - i : gBatchSize;
+        RingSpan span = ReserveWrite(n);
+        int want = span.firstLen + span.secondLen;
+
+        n = ProduceInto(span.first, span.firstLen, i);
+        if (n == span.firstLen) {
+            n += ProduceInto(span.second, span.secondLen, i + n);
+        }
+
+        CommitWrite(n); // Publishes the whole batch with one index update
+        i += n;
+        if (n < want) {
+            printf("Input ended after %d items\n", i);
+            break;
+        }
+
+        if (gRingFile != NULL && gIn - gSyncedIn >= (unsigned int)gSyncInterval) {
+            SyncProducer();
+        }
+    }
+
+    if (gRingFile != NULL) {
+        SyncProducer();
+    }
+
+    // Set the "producer done" flag in shared memory
+    MarkProducerDone();
+    WakeConsumer();
+    printf("Producer Completed\n");
+    return i;
+}
+
+// Message mode: send itemCnt records of random length in [1, gMaxMsgLen]
+void ProducerMsg(int itemCnt, int randSeed) {
     srand(randSeed);
-    in = GetIn();
-    out = GetOut();
+    gIn = GetIn();
+    gOutCache = GetOut();
 
     for (int i = 0; i < itemCnt; i++) {
-        while (((in + 1) % bufSize) == out) {
-            out = GetOut(); // Wait until space is available
+        int len = GetRand(1, gMaxMsgLen);
+        unsigned char* payload = ReserveMsg(len);
+        unsigned int checksum = 0;
+
+        // Filled in place in shared memory, the consumer reads it there too
+        for (int k = 0; k < len; k++) {
+            payload[k] = (unsigned char)GetRand(0, 255);
+            checksum += payload[k];
+        }
+        ((FrameHdr*)payload - 1)->itemNum = i;
+        int offset = (int)(payload - sizeof(FrameHdr) - (unsigned char*)gHdr->buf);
+        if (!gQuiet) {
+            printf("Producing Message %d with %d bytes (checksum %u) at Offset %d\n", i, len, checksum, offset);
         }
+        if (gLogging) {
+            LogItem(i, checksum, offset, len);
+        }
+        gValSum += checksum;
+        CommitMsg();
+    }
 
-        int val = GetRand(2, 5200);
-        WriteAtBufIndex(in, val);
-        printf("Producing Item %d with value %d at Index %d\n", i, val, in);
+    MarkProducerDone();
+    WakeConsumer();
+    printf("Producer Completed\n");
+}
+
+// Launch consumerCnt consumers and producerCnt producers on the MPMC queue
+// and wait for all of them. The items are split evenly between the producers.
+void LaunchMpmc(int itemCnt, int randSeed)
+{
+    char consumerNum[16];
+    pid_t pid;
 
-        in = (in + 1) % bufSize; // Update in index
-        SetIn(in);
+    for (int c = 0; c < gConsumerCnt; c++) {
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Fork Failed\n");
+            exit(1);
+        } else if (pid == 0) {
+            printf("Launching Consumer %d\n", c);
+            snprintf(consumerNum, sizeof(consumerNum), "%d", c);
+            execlp("./consumer", "consumer", "-n", gRingName, consumerNum, NULL);
+            exit(1);
+        }
     }
 
-    // Set the "producer done" flag in shared memory
-    SetProducerDone(1);
+    for (int p = 0; p < gProducerCnt; p++) {
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Fork Failed\n");
+            exit(1);
+        } else if (pid == 0) {
+            int first = (int)((long)itemCnt * p / gProducerCnt);
+            int last = (int)((long)itemCnt * (p + 1) / gProducerCnt);
+            char name[LOG_PATH_LEN];
+            long start = GetMicroTime();
+
+            printf("Starting Producer %d\n", p);
+            PlaceProducer(p);
+            if (gLogPath != NULL) {
+                snprintf(name, sizeof(name), "%s.prod%d", gLogPath, p);
+                OpenEventLog(name);
+            }
+            ProducerMpmc(first, last, randSeed + p);
+            snprintf(name, sizeof(name), "Producer %d", p);
+            PrintSummary(name, last - first, start);
+            CloseEventLog();
+            exit(0);
+        }
+    }
+
+    for (int i = 0; i < gProducerCnt + gConsumerCnt; i++) {
+        wait(NULL);
+    }
+    printf("Producers and Consumers Completed\n");
+}
+
+// MPMC mode: produce items numbered [first, last) into the shared queue
+void ProducerMpmc(int first, int last, int randSeed) {
+    gSource->seed(randSeed);
+
+    for (int i = first; i < last; i++) {
+        int val = NextVal();
+        int indx = MpmcEnqueue(val);
+        if (!gQuiet) {
+            printf("Producing Item %d with value %d at Index %d\n", i, val, indx);
+        }
+        if (gLogging) {
+            LogItem(i, val, indx, sizeof(int));
+        }
+        gValSum += val;
+    }
+
+    // The last producer to finish ends the stream; any consumer asleep on an
+    // empty queue is waiting on the slot at the final "in"
+    MarkProducerDone();
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&gHdr->consumerSleeping, memory_order_relaxed)) {
+        MpmcSlot* slots = (MpmcSlot*)gHdr->buf;
+        FutexWake(&slots[GetIn() & gHdr->mask].seq, INT_MAX);
+    }
     printf("Producer Completed\n");
 }
 
-// Set the producer done flag
-void SetProducerDone(int val) {
-    SetHeaderVal(4, val);  // Assume this flag is at index 4 in shared memory
+// Put val in the MPMC queue, waiting while it is full. Returns the slot used.
+int MpmcEnqueue(int val)
+{
+    MpmcSlot* slots = (MpmcSlot*)gHdr->buf;
+    unsigned int pos = atomic_load_explicit(&gHdr->in, memory_order_relaxed);
+    Backoff bo = {0};
+
+    for (;;) {
+        MpmcSlot* slot = &slots[pos & gHdr->mask];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+
+        if (diff == 0) {
+            // Slot is free for this position: claim it, fill it, hand it over
+            if (atomic_compare_exchange_weak_explicit(&gHdr->in, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->val = val;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                atomic_thread_fence(memory_order_seq_cst);
+                if (atomic_load_explicit(&gHdr->consumerSleeping, memory_order_relaxed)) {
+                    FutexWake(&slot->seq, INT_MAX);
+                }
+                StatAdd(&gHdr->prodStats.items, 1);
+                return pos & gHdr->mask;
+            }
+            // Lost the race; pos now holds the current "in"
+        } else if (diff < 0) {
+            // Queue is full: wait for a consumer to free this slot
+            MpmcBackoff(&bo, &slot->seq, seq);
+            pos = atomic_load_explicit(&gHdr->in, memory_order_relaxed);
+        } else {
+            // Another producer already took this position
+            pos = atomic_load_explicit(&gHdr->in, memory_order_relaxed);
+        }
+    }
 }
 
+// One step of the spin, yield, sleep strategy while waiting for an MPMC slot
+// whose sequence number is still seen
+void MpmcBackoff(Backoff* bo, atomic_uint* seq, unsigned int seen)
+{
+    if (bo->start == 0) {
+        bo->start = GetMicroTime();
+        StatAdd(&gHdr->prodStats.stalls, 1);
+    }
 
-void SetBufSize(int val) { SetHeaderVal(0, val); }
-void SetItemCnt(int val) { SetHeaderVal(1, val); }
-void SetIn(int val) { SetHeaderVal(2, val); }
-void SetOut(int val) { SetHeaderVal(3, val); }
-int GetBufSize() { return GetHeaderVal(0); }
-int GetItemCnt() { return GetHeaderVal(1); }
-int GetIn() { return GetHeaderVal(2); }
-int GetOut() { return GetHeaderVal(3); }
+    if (bo->yields == 0 && ((++bo->spins & 63) != 0 || GetMicroTime() - bo->start < gHdr->spinUsec)) {
+        CpuRelax();
+        StatAdd(&gHdr->prodStats.spins, 1);
+    } else if (bo->yields < gHdr->yieldCnt) {
+        bo->yields++;
+        sched_yield();
+    } else {
+        StatAdd(&gHdr->prodStats.sleeps, 1);
+        atomic_fetch_add(&gHdr->producerSleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(seq) == seen) {
+            FutexWait(seq, seen);
+        }
+        atomic_fetch_sub(&gHdr->producerSleeping, 1);
+    }
+}
 
-int GetHeaderVal(int i)
+// Fill len slots straight from the payload source and return how many it had
+int ProduceInto(int* slots, int len, int itemNum)
 {
-    int val;
-    void* ptr = gShmPtr + i * sizeof(int);
-    memcpy(&val, ptr, sizeof(int));
-    return val;
+    if (gStampTimes) {
+        for (int k = 0; k < len; k++) {
+            slots[k] = NextVal();
+        }
+    } else {
+        len = gSource->fill(slots, len);
+    }
+
+    if (gReduceWorkers > 0) {
+        for (int k = 0; k < len; k++) {
+            gProd = gProd * ((slots[k] % NUM_LIMIT + NUM_LIMIT) % NUM_LIMIT) % NUM_LIMIT;
+        }
+    }
+
+    for (int k = 0; k < len; k++) {
+        int val = slots[k];
+        int indx = (int)(slots + k - gHdr->buf);
+        if (!gQuiet) {
+            printf("Producing Item %d with value %d at Index %d\n", itemNum + k, val, indx);
+        }
+        if (gLogging) {
+            LogItem(itemNum + k, val, indx, sizeof(int));
+        }
+        gValSum += val;
+    }
+    return len;
 }
 
-void SetHeaderVal(int i, int val)
+// Reserve up to n free slots, waiting until at least one is free. The shared
+// "out" is only re-read when the cached copy doesn't show n free slots.
+RingSpan ReserveWrite(int n)
 {
-    void* ptr = gShmPtr + i * sizeof(int);
-    memcpy(ptr, &val, sizeof(int));
+    unsigned int bufSize = gHdr->bufSize;
+    unsigned int free = bufSize - (gIn - gOutCache);
+
+    if (free < (unsigned int)n) {
+        gOutCache = GetOut();
+        RecordDepth(gIn - gOutCache);
+        while ((free = bufSize - (gIn - gOutCache)) == 0) {
+            gOutCache = WaitForSpace(gOutCache); // Wait until space is available
+        }
+    }
+    return MakeSpan(gIn, free < (unsigned int)n ? (int)free : n);
 }
 
-void WriteAtBufIndex(int indx, int val)
+// Publish n slots filled after ReserveWrite
+void CommitWrite(int n)
 {
-    void* ptr = gShmPtr + 4 * sizeof(int) + indx * sizeof(int);
-    memcpy(ptr, &val, sizeof(int));
+    gIn += n;
+    SetIn(gIn);
+    WakeConsumer();
+    StatAdd(&gHdr->prodStats.items, n);
+}
+
+// Reserve a frame for a len-byte message, waiting for space, and return a
+// pointer to its payload in shared memory. Nothing is visible until CommitMsg.
+void* ReserveMsg(int len)
+{
+    unsigned int ringBytes = gHdr->bufSize * sizeof(int);
+    unsigned int frameSize = FrameSize(len);
+    unsigned int offset = gIn & (ringBytes - 1);
+    unsigned int tail = ringBytes - offset;
+    unsigned int need = frameSize <= tail ? frameSize : tail + frameSize;
+    unsigned char* data = (unsigned char*)gHdr->buf;
+
+    if (ringBytes - (gIn - gOutCache) < need) {
+        gOutCache = GetOut();
+        RecordDepth(gIn - gOutCache);
+        while (ringBytes - (gIn - gOutCache) < need) {
+            gOutCache = WaitForSpace(gOutCache); // Wait until space is available
+        }
+    }
+
+    // Doesn't fit before the end: pad out the tail and start at offset 0.
+    // The padding is published together with the frame.
+    gPendingFrame = frameSize;
+    if (frameSize > tail) {
+        ((FrameHdr*)(data + offset))->len = FRAME_PAD;
+        gPendingFrame += tail;
+        offset = 0;
+    }
+
+    FrameHdr* frame = (FrameHdr*)(data + offset);
+    frame->len = len;
+    return frame + 1;
+}
+
+// Publish the frame reserved by ReserveMsg
+void CommitMsg()
+{
+    gIn += gPendingFrame;
+    SetIn(gIn);
+    WakeConsumer();
+    StatAdd(&gHdr->prodStats.items, 1);
+}
+
+// Bump a statistics counter. Each side has a single writer outside MPMC mode,
+// so a plain load and store is enough there and keeps the lock prefix off the hot path.
+void StatAdd(atomic_ulong* cnt, unsigned long n)
+{
+    if (gHdr->mpmc) {
+        atomic_fetch_add_explicit(cnt, n, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(cnt, atomic_load_explicit(cnt, memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
+// Count the ring depth, in slots or in bytes in message mode, in the histogram
+void RecordDepth(unsigned int used)
+{
+    unsigned long cap = gHdr->maxMsgLen > 0 ? gHdr->bufSize * sizeof(int) : (unsigned long)gHdr->bufSize;
+    StatAdd(&gHdr->prodStats.depthHist[used * (DEPTH_BUCKETS - 1UL) / cap], 1);
+}
+
+// Bytes taken by a record with a len-byte payload, header and alignment included
+unsigned int FrameSize(int len)
+{
+    return (sizeof(FrameHdr) + len + FRAME_ALIGN - 1) & ~(FRAME_ALIGN - 1);
+}
+
+// Write the slots produced since the last sync to disk, then the header with
+// durableIn moved up to "in", so durableIn never covers data that isn't on disk
+void SyncProducer()
+{
+    unsigned int cnt = gIn - gSyncedIn;
+
+    if (cnt >= (unsigned int)gHdr->bufSize) {
+        SyncRange(gHdr->buf, gHdr->bufSize * sizeof(int));
+    } else if (cnt > 0) {
+        RingSpan span = MakeSpan(gSyncedIn, cnt);
+        SyncRange(span.first, span.firstLen * sizeof(int));
+        SyncRange(span.second, span.secondLen * sizeof(int));
+    }
+    gHdr->durableIn = gIn;
+    SyncRange(gHdr, sizeof(ShmHeader));
+    gSyncedIn = gIn;
+}
+
+// msync the pages covering [addr, addr + len)
+void SyncRange(void* addr, size_t len)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    char* start = (char*)((unsigned long)addr & ~(pageSize - 1));
+
+    if (len > 0 && msync(start, (char*)addr + len - start, MS_SYNC) == -1) {
+        perror("msync failed");
+    }
+}
+
+// Describe n slots starting at the free-running index start
+RingSpan MakeSpan(unsigned int start, int n)
+{
+    RingSpan span;
+    int indx = start & gHdr->mask;
+    int tail = gHdr->bufSize - indx;
+
+    span.first = gHdr->buf + indx;
+    span.firstLen = n < tail ? n : tail;
+    span.second = gHdr->buf;
+    span.secondLen = n - span.firstLen;
+    return span;
+}
+
+// Segment size for a buffer of bufSize items: header plus buffer, rounded up
+// to whole pages (whole huge pages with -H)
+size_t GetShmSize(int bufSize)
+{
+    size_t pageSize = gHugePages ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t slotSize = gMpmc ? sizeof(MpmcSlot) : sizeof(int);
+    size_t size = sizeof(ShmHeader) + (size_t)bufSize * slotSize;
+    return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+// Smallest power of two that is >= val
+int RoundUpPow2(int val)
+{
+    int pow2 = 1;
+    while (pow2 < val) {
+        pow2 <<= 1;
+    }
+    return pow2;
+}
+
+// Count this producer as done (release, so every item it published is visible)
+void MarkProducerDone() {
+    atomic_fetch_add_explicit(&gHdr->producerDone, 1, memory_order_release);
+}
+
+void SetBufSize(int val) { gHdr->bufSize = val; }
+void SetItemCnt(int val) { gHdr->itemCnt = val; }
+int GetBufSize() { return gHdr->bufSize; }
+int GetItemCnt() { return gHdr->itemCnt; }
+
+// The producer is the only writer of "in", so a release store is enough to
+// publish the slot; the acquire load of "out" pairs with the consumer's release.
+void SetIn(unsigned int val) { atomic_store_explicit(&gHdr->in, val, memory_order_release); }
+void SetOut(unsigned int val) { atomic_store_explicit(&gHdr->out, val, memory_order_release); }
+unsigned int GetIn() { return atomic_load_explicit(&gHdr->in, memory_order_relaxed); }
+unsigned int GetOut() { return atomic_load_explicit(&gHdr->out, memory_order_acquire); }
+
+// Value for the next int item: from the payload source, or the send time with -T
+int NextVal()
+{
+    struct timespec ts;
+    int val = 0;
+
+    if (!gStampTimes) {
+        gSource->fill(&val, 1);
+        return val;
+    }
+    // Low 32 bits of the monotonic clock in ns; the consumer subtracts it
+    // from its own clock modulo 2^32, which is fine for latencies under 4 s
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int)(unsigned int)(ts.tv_sec * 1000000000L + ts.tv_nsec);
 }
 
 int GetRand(int x, int y)
@@ -179,3 +1162,581 @@ int GetRand(int x, int y)
     r = x + r % (y - x + 1);
     return r;
 }
+
+// Payload sources for -g. rand keeps the original libc stream; xoshiro is a
+// reproducible generator without rand()'s lock; file and stdin feed real data.
+const PayloadSource gSources[] = {
+    { "rand", NoOpen, RandSeed, RandFill },
+    { "xoshiro", NoOpen, XoshiroSeed, XoshiroFill },
+    { "file", FileOpen, NoSeed, FileFill },
+    { "stdin", NoOpen, NoSeed, StdinFill },
+};
+
+// Pick the source named by spec, "name" or "name:arg", and open it
+void OpenSource(const char* spec)
+{
+    const char* colon = strchr(spec, ':');
+    size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+    for (size_t s = 0; s < sizeof(gSources) / sizeof(gSources[0]); s++) {
+        if (strlen(gSources[s].name) == len && strncmp(gSources[s].name, spec, len) == 0) {
+            gSource = &gSources[s];
+            gSource->open(colon != NULL ? colon + 1 : NULL);
+            return;
+        }
+    }
+    printf("Unknown payload source %s. Use rand, xoshiro, file:<path> or stdin.\n", spec);
+    exit(1);
+}
+
+// Throw away the next cnt values
+void SkipVals(unsigned int cnt)
+{
+    int scratch[XO_BATCH];
+
+    while (cnt > 0) {
+        int n = cnt < XO_BATCH ? (int)cnt : XO_BATCH;
+        if (gSource->fill(scratch, n) < n) {
+            return;
+        }
+        cnt -= n;
+    }
+}
+
+void RandSeed(int seed) { srand(seed); }
+
+int RandFill(int* vals, int n)
+{
+    for (int k = 0; k < n; k++) {
+        vals[k] = GetRand(2, 5200);
+    }
+    return n;
+}
+
+// Seed every lane from one splitmix64 stream, as the xoshiro authors suggest
+void XoshiroSeed(int seed)
+{
+    uint64_t sm = (uint64_t)(unsigned int)seed;
+
+    for (int w = 0; w < 4; w++) {
+        for (int l = 0; l < XO_LANES; l++) {
+            gXo[w][l] = (uint32_t)(SplitMix64(&sm) >> 32);
+        }
+    }
+    gXoPos = XO_BATCH;
+}
+
+// Copy out buffered values, refilling XO_BATCH at a time. The stream only
+// depends on the seed, not on how callers slice it.
+int XoshiroFill(int* vals, int n)
+{
+    for (int k = 0; k < n; ) {
+        if (gXoPos == XO_BATCH) {
+            XoshiroRefill();
+        }
+        int cnt = XO_BATCH - gXoPos < n - k ? XO_BATCH - gXoPos : n - k;
+        memcpy(vals + k, gXoBuf + gXoPos, cnt * sizeof(int));
+        gXoPos += cnt;
+        k += cnt;
+    }
+    return n;
+}
+
+// Step all lanes XO_BATCH / XO_LANES times. Values land in [2, 5200] like
+// GetRand, by multiply-shift on the top 19 bits instead of a division, which
+// stays within 32 bits so it vectorizes too (bias about 1%).
+void XoshiroRefill()
+{
+    XoVec s0 = gXo[0], s1 = gXo[1], s2 = gXo[2], s3 = gXo[3];
+
+    for (int k = 0; k < XO_BATCH; k += XO_LANES) {
+        XoVec r = s1 * 5;
+        r = ((r << 7) | (r >> 25)) * 9;
+        XoVec t = s1 << 9;
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = (s3 << 11) | (s3 >> 21);
+
+        r = (((r >> 13) * 5199) >> 19) + 2;
+        memcpy(gXoBuf + k, &r, sizeof(r));
+    }
+    gXo[0] = s0;
+    gXo[1] = s1;
+    gXo[2] = s2;
+    gXo[3] = s3;
+    gXoPos = 0;
+}
+
+uint64_t SplitMix64(uint64_t* x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Map a file of raw ints; a trailing partial int is ignored
+void FileOpen(const char* path)
+{
+    struct stat st;
+    int fd = path != NULL ? open(path, O_RDONLY) : -1;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        printf("Failed to open payload file %s.\n", path != NULL ? path : "(none, use file:<path>)");
+        exit(1);
+    }
+    gSourceCnt = st.st_size / sizeof(int);
+    if (gSourceCnt > 0) {
+        gFileVals = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (gFileVals == MAP_FAILED) {
+            printf("Failed to map payload file %s.\n", path);
+            exit(1);
+        }
+        madvise((void*)gFileVals, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+int FileFill(int* vals, int n)
+{
+    if (n > gSourceCnt - gFilePos) {
+        n = (int)(gSourceCnt - gFilePos);
+    }
+    memcpy(vals, gFileVals + gFilePos, n * sizeof(int));
+    gFilePos += n;
+    return n;
+}
+
+// Read raw ints from stdin straight into the ring slots
+int StdinFill(int* vals, int n)
+{
+    size_t want = n * sizeof(int);
+    size_t got = 0;
+
+    while (got < want) {
+        ssize_t r = read(STDIN_FILENO, (char*)vals + got, want - got);
+        if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    return (int)(got / sizeof(int));
+}
+
+void NoOpen(const char* arg) { (void)arg; }
+void NoSeed(int seed) { (void)seed; }
+
+// Wait until the consumer moves "out" past the given value. Spins for spinUsec,
+// then yields yieldCnt times, then sleeps on the "out" futex word.
+unsigned int WaitForSpace(unsigned int out)
+{
+    unsigned int crnt;
+    long start = GetMicroTime();
+    int spins = 0;
+    int yields = 0;
+
+    StatAdd(&gHdr->prodStats.stalls, 1);
+    while ((crnt = GetOut()) == out) {
+        if (yields == 0 && (++spins & 63) != 0) {
+            CpuRelax();
+        } else if (yields == 0 && GetMicroTime() - start < gHdr->spinUsec) {
+            CpuRelax();
+        } else if (yields < gHdr->yieldCnt) {
+            yields++;
+            sched_yield();
+        } else {
+            // Announce the sleep, then re-check so a publish in between isn't missed
+            StatAdd(&gHdr->prodStats.sleeps, 1);
+            atomic_fetch_add(&gHdr->producerSleeping, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (GetOut() == out) {
+                FutexWait(&gHdr->out, out);
+            }
+            atomic_fetch_sub(&gHdr->producerSleeping, 1);
+        }
+    }
+    StatAdd(&gHdr->prodStats.spins, spins);
+    return crnt;
+}
+
+// Wake the consumer if it went to sleep waiting for items. The fence orders the
+// preceding publish before the flag check (pairs with the fence in the consumer).
+// An external consumer sleeps in epoll_wait, so it gets the doorbell instead.
+void WakeConsumer()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&gHdr->consumerSleeping, memory_order_relaxed)) {
+        if (gDoorbell >= 0) {
+            uint64_t one = 1;
+            if (write(gDoorbell, &one, sizeof(one)) != sizeof(one)) {
+                perror("Doorbell write failed");
+            }
+        } else {
+            // Several reduction threads may be asleep on "in"
+            FutexWake(&gHdr->in, gHdr->reduceWorkers > 0 ? INT_MAX : 1);
+        }
+    }
+}
+
+#ifdef __linux__
+// Listen on the Unix socket named after the ring, which the consumer connects
+// to for the doorbell. Only one producer can hold the name.
+int ListenDoorbell()
+{
+    struct sockaddr_un addr;
+    socklen_t addrLen = GetDoorbellAddr(&addr, gRingName);
+    int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (srv == -1) {
+        printf("Failed to create the doorbell socket for ring %s.\n", gRingName);
+        exit(1);
+    }
+    if (bind(srv, (struct sockaddr*)&addr, addrLen) == -1 || listen(srv, 1) == -1) {
+        printf("Failed to listen for a consumer on ring %s. Is another producer using the name?\n", gRingName);
+        exit(1);
+    }
+    return srv;
+}
+
+// Create the ring's doorbell eventfd and pass it to the consumer that connects
+// to srv. Waits for the consumer, so it is attached before the first item and
+// never misses a wakeup.
+void ServeDoorbell(int srv)
+{
+    char data = 'R';
+    struct iovec iov = { &data, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = { 0 };
+    struct cmsghdr* cmsg;
+    int conn;
+
+    gDoorbell = eventfd(0, 0);
+    if (gDoorbell == -1) {
+        printf("Failed to create the doorbell for ring %s.\n", gRingName);
+        exit(1);
+    }
+
+    printf("Waiting for a consumer on ring %s\n", gRingName);
+    fflush(stdout);
+    conn = accept(srv, NULL, NULL);
+    if (conn == -1) {
+        printf("Failed to accept a consumer on ring %s.\n", gRingName);
+        exit(1);
+    }
+
+    // The eventfd goes across as SCM_RIGHTS ancillary data
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &gDoorbell, sizeof(int));
+    if (sendmsg(conn, &msg, 0) == -1) {
+        printf("Failed to send the doorbell for ring %s.\n", gRingName);
+        exit(1);
+    }
+    close(conn);
+    close(srv);
+}
+#else
+// eventfd is Linux-only, and so is the "consumer -R" event loop it wakes
+int ListenDoorbell()
+{
+    printf("Serving a ring to an external consumer with -E needs Linux.\n");
+    exit(1);
+}
+
+void ServeDoorbell(int srv)
+{
+    (void)srv;
+}
+#endif
+
+// Address of the socket the doorbell for a ring is served on, in the abstract
+// namespace so nothing is left in the filesystem (must match consumer.c)
+socklen_t GetDoorbellAddr(struct sockaddr_un* addr, const char* ringName)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "ringbell:%s", ringName);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+#ifdef __linux__
+// Sleep while *addr still holds val. Not FUTEX_PRIVATE since the word is in shared memory.
+void FutexWait(atomic_uint* addr, unsigned int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+// Wake up to cnt processes sleeping on addr
+void FutexWake(atomic_uint* addr, int cnt)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, cnt, NULL, NULL, 0);
+}
+#else
+// No futex outside Linux: nap briefly and let the caller re-check
+void FutexWait(atomic_uint* addr, unsigned int val)
+{
+    if (atomic_load(addr) == val) {
+        usleep(100);
+    }
+}
+
+void FutexWake(atomic_uint* addr, int cnt)
+{
+    (void)addr;
+    (void)cnt;
+}
+#endif
+
+void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+long GetMicroTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Start the background writer for the binary event log at path
+void OpenEventLog(const char* path)
+{
+    gLog.fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (gLog.fd == -1) {
+        printf("Failed to open event log %s\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < LOG_BUF_CNT; i++) {
+        gLog.bufs[i] = malloc(LOG_BUF_EVENTS * sizeof(LogEvent));
+        if (gLog.bufs[i] == NULL) {
+            printf("Failed to allocate event log buffers\n");
+            exit(1);
+        }
+    }
+    gLog.head = 0;
+    gLog.tail = 0;
+    gLog.full = 0;
+    gLog.closing = 0;
+    gLog.fill[0] = 0;
+    pthread_mutex_init(&gLog.lock, NULL);
+    pthread_cond_init(&gLog.cond, NULL);
+    pthread_create(&gLog.thread, NULL, EventLogWriter, NULL);
+    gLogging = 1;
+}
+
+// Record one item. Only touches the current buffer except when it fills up.
+void LogItem(int itemNum, int val, int indx, int len)
+{
+    struct timespec ts;
+    LogEvent* ev = &gLog.bufs[gLog.head][gLog.fill[gLog.head]++];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->timeNs = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    ev->itemNum = itemNum;
+    ev->val = val;
+    ev->indx = indx;
+    ev->len = len;
+
+    if (gLog.fill[gLog.head] == LOG_BUF_EVENTS) {
+        HandOffLogBuf();
+    }
+}
+
+// Pass the current buffer to the writer thread and move on to the next one,
+// waiting only if the writer has fallen a whole LOG_BUF_CNT buffers behind
+void HandOffLogBuf()
+{
+    pthread_mutex_lock(&gLog.lock);
+    gLog.full++;
+    pthread_cond_broadcast(&gLog.cond);
+    while (gLog.full == LOG_BUF_CNT) {
+        pthread_cond_wait(&gLog.cond, &gLog.lock);
+    }
+    gLog.head = (gLog.head + 1) % LOG_BUF_CNT;
+    gLog.fill[gLog.head] = 0;
+    pthread_mutex_unlock(&gLog.lock);
+}
+
+// Background thread: write out full buffers in order until the log is closed
+void* EventLogWriter(void* param)
+{
+    (void)param;
+    pthread_mutex_lock(&gLog.lock);
+    for (;;) {
+        while (gLog.full == 0 && !gLog.closing) {
+            pthread_cond_wait(&gLog.cond, &gLog.lock);
+        }
+        if (gLog.full == 0) {
+            break;
+        }
+        int buf = gLog.tail;
+        pthread_mutex_unlock(&gLog.lock);
+
+        size_t size = gLog.fill[buf] * sizeof(LogEvent);
+        if (write(gLog.fd, gLog.bufs[buf], size) != (ssize_t)size) {
+            perror("Event log write failed");
+        }
+
+        pthread_mutex_lock(&gLog.lock);
+        gLog.tail = (gLog.tail + 1) % LOG_BUF_CNT;
+        gLog.full--;
+        pthread_cond_broadcast(&gLog.cond);
+    }
+    pthread_mutex_unlock(&gLog.lock);
+    return NULL;
+}
+
+// Flush what's left and stop the writer thread
+void CloseEventLog()
+{
+    if (!gLogging) {
+        return;
+    }
+    pthread_mutex_lock(&gLog.lock);
+    if (gLog.fill[gLog.head] > 0) {
+        gLog.full++;
+    }
+    gLog.closing = 1;
+    pthread_cond_broadcast(&gLog.cond);
+    pthread_mutex_unlock(&gLog.lock);
+
+    pthread_join(gLog.thread, NULL);
+    close(gLog.fd);
+    for (int i = 0; i < LOG_BUF_CNT; i++) {
+        free(gLog.bufs[i]);
+    }
+    gLogging = 0;
+}
+
+// Print the end-of-run statistics for one side
+void PrintSummary(const char* who, long items, long startUsec)
+{
+    double secs = (GetMicroTime() - startUsec) / 1e6;
+    printf("%s: %ld items in %.3f s (%.0f items/s), value sum %ld\n",
+           who, items, secs, secs > 0 ? items / secs : 0.0, gValSum);
+}
+
+// Parse a comma-separated CPU list such as "0,2,4" into cpus, returning the count
+int ParseCpuList(const char* list, int* cpus)
+{
+    int cnt = 0;
+    const char* ptr = list;
+
+    while (*ptr != '\0') {
+        char* end;
+        long cpu = strtol(ptr, &end, 10);
+        if (end == ptr || cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_CONF) || cnt == MAX_PIN_CPUS ||
+            (*end != ',' && *end != '\0')) {
+            printf("Invalid CPU list \"%s\"\n", list);
+            exit(1);
+        }
+        cpus[cnt++] = (int)cpu;
+        ptr = *end == ',' ? end + 1 : end;
+    }
+    return cnt;
+}
+
+// Bind the pages of [addr, addr + len) to one NUMA node. For a shm mapping the
+// policy belongs to the shared object, so it holds for the consumer's pages too.
+void BindToNode(void* addr, size_t len, int node)
+{
+#ifdef __linux__
+    unsigned long nodeMask[16] = {0};
+
+    if (node >= (int)(sizeof(nodeMask) * 8)) {
+        printf("Invalid NUMA node %d\n", node);
+        exit(1);
+    }
+    nodeMask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, addr, len, MPOL_BIND, nodeMask, sizeof(nodeMask) * 8, MPOL_MF_MOVE) == -1) {
+        printf("Failed to bind ring memory to NUMA node %d\n", node);
+        exit(1);
+    }
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+    printf("NUMA binding is not supported on this OS\n");
+#endif
+}
+
+// Pin producer number producerNum if -p was given, then report where it runs
+void PlaceProducer(int producerNum)
+{
+    char who[32];
+
+    if (gProducerCpuCnt > 0) {
+        PinToCpu(gProducerCpus[producerNum % gProducerCpuCnt]);
+    }
+    snprintf(who, sizeof(who), "Producer %d", producerNum);
+    ReportPlacement(who);
+}
+
+// Pin the calling process to one CPU
+void PinToCpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        printf("Failed to pin to CPU %d\n", cpu);
+        exit(1);
+    }
+#else
+    (void)cpu;
+    printf("CPU pinning is not supported on this OS\n");
+#endif
+}
+
+// Print where this process is running: CPU, NUMA node, package and core
+void ReportPlacement(const char* who)
+{
+#ifdef __linux__
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    int package;
+    int core;
+
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    package = ReadCpuTopology(cpu, "physical_package_id");
+    core = ReadCpuTopology(cpu, "core_id");
+    printf("%s on CPU %u (node %u, package %d, core %d)\n", who, cpu, node, package, core);
+#else
+    printf("%s placement unknown on this OS\n", who);
+#endif
+}
+
+// Read one value from /sys/devices/system/cpu/cpuN/topology, -1 if missing
+int ReadCpuTopology(unsigned int cpu, const char* field)
+{
+    char path[128];
+    int val = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, field);
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%d", &val) != 1) {
+            val = -1;
+        }
+        fclose(f);
+    }
+    return val;
+}
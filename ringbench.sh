@@ -0,0 +1,77 @@
+#!/bin/bash
+#
+# Throughput and latency sweep for the producer/consumer ring.
+#
+# Builds producer.c and consumer.c into a scratch directory, runs the pair in
+# quiet, timestamped mode (-q -T) for every combination of buffer size, item
+# count and batch size, and prints one result row per run as CSV (default)
+# or JSON (-j). Items/s and latency come from the consumer's summary lines.
+#
+# Usage: ./ringbench.sh [-j] [-r repeats]
+# The sweep can be changed through BUF_SIZES, ITEM_CNTS and BATCH_SIZES, e.g.
+#   BUF_SIZES="64 4096" BATCH_SIZES="1 32" ./ringbench.sh -j > bench.json
+
+BUF_SIZES=${BUF_SIZES:-"16 256 4096 65536"}
+ITEM_CNTS=${ITEM_CNTS:-"1000000"}
+BATCH_SIZES=${BATCH_SIZES:-"1 16 256"}
+CFLAGS=${CFLAGS:-"-O2"}
+
+json=0
+repeats=1
+while getopts "jr:" opt; do
+    case $opt in
+    j) json=1 ;;
+    r) repeats=$OPTARG ;;
+    *) echo "Usage: $0 [-j] [-r repeats]" >&2; exit 1 ;;
+    esac
+done
+
+srcDir=$(cd "$(dirname "$0")" && pwd)
+buildDir=$(mktemp -d)
+trap 'rm -rf "$buildDir"' EXIT
+
+gcc $CFLAGS -pthread -o "$buildDir/producer" "$srcDir/producer.c" || exit 1
+gcc $CFLAGS -pthread -o "$buildDir/consumer" "$srcDir/consumer.c" || exit 1
+cd "$buildDir" || exit 1
+
+if [ $json -eq 1 ]; then
+    echo "["
+else
+    echo "bufSize,itemCnt,batchSize,run,itemsPerSec,mbPerSec,p50Ns,p99Ns,p999Ns"
+fi
+
+first=1
+for bufSize in $BUF_SIZES; do
+    for itemCnt in $ITEM_CNTS; do
+        for batchSize in $BATCH_SIZES; do
+            for run in $(seq 1 "$repeats"); do
+                out=$(./producer -q -T -b "$batchSize" "$bufSize" "$itemCnt" 1)
+
+                # "Consumer 0: N items in S s (R items/s), ..."
+                rate=$(echo "$out" | sed -n 's/^Consumer 0: .*(\([0-9]*\) items\/s).*/\1/p')
+                # "Consumer 0 latency: p50 X ns, p99 Y ns, p99.9 Z ns, ..."
+                lat=$(echo "$out" | sed -n 's/^Consumer 0 latency: p50 \([0-9]*\) ns, p99 \([0-9]*\) ns, p99.9 \([0-9]*\) ns.*/\1 \2 \3/p')
+                read -r p50 p99 p999 <<< "$lat"
+                if [ -z "$rate" ] || [ -z "$p50" ]; then
+                    echo "Run failed: bufSize=$bufSize itemCnt=$itemCnt batchSize=$batchSize" >&2
+                    continue
+                fi
+                mbps=$(awk -v r="$rate" 'BEGIN { printf "%.1f", r * 4 / 1e6 }')
+
+                if [ $json -eq 1 ]; then
+                    [ $first -eq 1 ] || echo ","
+                    printf '  {"bufSize": %d, "itemCnt": %d, "batchSize": %d, "run": %d, "itemsPerSec": %d, "mbPerSec": %s, "p50Ns": %d, "p99Ns": %d, "p999Ns": %d}' \
+                        "$bufSize" "$itemCnt" "$batchSize" "$run" "$rate" "$mbps" "$p50" "$p99" "$p999"
+                else
+                    echo "$bufSize,$itemCnt,$batchSize,$run,$rate,$mbps,$p50,$p99,$p999"
+                fi
+                first=0
+            done
+        done
+    done
+done
+
+if [ $json -eq 1 ]; then
+    echo
+    echo "]"
+fi
@@ -0,0 +1,249 @@
+/*
+ringstat: live monitor for the producer/consumer ring.
+Attaches read-only to a running ring and prints the counters both sides keep
+in the shared memory header, as rates, once per interval.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// These must match producer.c and consumer.c
+#define CACHE_LINE 64
+#define LOG_PATH_LEN 128
+#define MAX_PIN_CPUS 64
+#define RING_MAGIC 0x52494E47
+#define RING_VERSION 3
+#define DEPTH_BUCKETS 9
+
+// Rows between column headings
+#define HEADING_EVERY 20
+
+// Counters for one side of the ring (must match producer.c)
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ulong items;
+    atomic_ulong stalls;
+    atomic_ulong spins;
+    atomic_ulong sleeps;
+    atomic_ulong depthHist[DEPTH_BUCKETS];
+} SideStats;
+
+// Layout of the shared memory header (must match producer.c)
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    size_t shmSize;
+    int hugePages;
+    int bufSize;
+    unsigned int mask;
+    int itemCnt;
+    int spinUsec;
+    int yieldCnt;
+    int batchSize;
+    int maxMsgLen;
+    int mpmc;
+    int producerCnt;
+    int consumerCnt;
+    int quiet;
+    int stampTimes;
+    char logPath[LOG_PATH_LEN];
+    int consumerCpus[MAX_PIN_CPUS];
+    int consumerCpuCnt;
+    int persistent;
+    int syncInterval;
+    int reduceWorkers;
+    atomic_int producerDone;
+    atomic_int consumerDone;
+    _Alignas(CACHE_LINE) atomic_uint in;
+    atomic_int consumerSleeping;
+    _Alignas(CACHE_LINE) atomic_uint out;
+    atomic_int producerSleeping;
+    _Alignas(CACHE_LINE) unsigned int durableIn;
+    unsigned int durableOut;
+    SideStats prodStats;
+    SideStats consStats;
+} ShmHeader;
+
+// Plain copy of one side's counters at one moment
+typedef struct {
+    unsigned long items;
+    unsigned long stalls;
+    unsigned long spins;
+    unsigned long sleeps;
+    unsigned long depthHist[DEPTH_BUCKETS];
+} StatSnap;
+
+ShmHeader* gHdr;
+volatile sig_atomic_t gStop = 0;
+
+ShmHeader* AttachRing(const char*, const char*);
+void TakeSnap(SideStats*, StatSnap*);
+void PrintHeading();
+void PrintRow(double, StatSnap*, StatSnap*, StatSnap*, StatSnap*, double);
+void PrintDepthHist(StatSnap*, StatSnap*);
+long GetMicroTime();
+void OnSignal(int);
+
+int main(int argc, char* argv[])
+{
+    const char* name = "OS_HW1_ryanSario";
+    const char* ringFile = NULL;
+    int intervalMs = 1000;
+    int count = 0;
+    int opt;
+
+    // Options: -i <ms> between rows, -c <rows> to stop after that many,
+    // -f <file> to watch a persistent ring instead of a named segment
+    while ((opt = getopt(argc, argv, "i:c:f:")) != -1) {
+        switch (opt) {
+        case 'i': intervalMs = atoi(optarg); break;
+        case 'c': count = atoi(optarg); break;
+        case 'f': ringFile = optarg; break;
+        default:
+            printf("Usage: %s [-i intervalMs] [-c count] [-f ringFile] [ringName]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        name = argv[optind];
+    }
+
+    if (intervalMs <= 0 || count < 0) {
+        printf("Invalid interval or count. Interval must be greater than 0.\n");
+        exit(1);
+    }
+
+    gHdr = AttachRing(name, ringFile);
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+
+    printf("Ring %s: bufSize = %d, itemCnt = %d, %d producer(s), %d consumer(s)%s\n",
+           ringFile != NULL ? ringFile : name, gHdr->bufSize, gHdr->itemCnt, gHdr->producerCnt,
+           gHdr->consumerCnt, gHdr->maxMsgLen > 0 ? ", message mode (depth in bytes)" : "");
+
+    StatSnap prodPrev, consPrev, prod, cons;
+    long start = GetMicroTime();
+    long prev = start;
+
+    TakeSnap(&gHdr->prodStats, &prodPrev);
+    TakeSnap(&gHdr->consStats, &consPrev);
+    for (int row = 0; !gStop && (count == 0 || row < count); row++) {
+        struct timespec ts = { intervalMs / 1000, (intervalMs % 1000) * 1000000L };
+        int finished;
+
+        nanosleep(&ts, NULL); // Cut short by a signal, which ends the loop
+        finished = atomic_load(&gHdr->consumerDone) == gHdr->consumerCnt;
+
+        long now = GetMicroTime();
+        TakeSnap(&gHdr->prodStats, &prod);
+        TakeSnap(&gHdr->consStats, &cons);
+        if (row % HEADING_EVERY == 0) {
+            PrintHeading();
+        }
+        PrintRow((now - start) / 1e6, &prod, &prodPrev, &cons, &consPrev, (now - prev) / 1e6);
+        prodPrev = prod;
+        consPrev = cons;
+        prev = now;
+
+        if (finished) {
+            printf("All consumers are done\n");
+            break;
+        }
+    }
+
+    PrintDepthHist(&prodPrev, &consPrev);
+    return 0;
+}
+
+// Map a ring read-only, so watching it can't disturb either side
+ShmHeader* AttachRing(const char* name, const char* ringFile)
+{
+    ShmHeader* hdr;
+    int fd = ringFile != NULL ? open(ringFile, O_RDONLY) : shm_open(name, O_RDONLY, 0);
+
+    if (fd == -1) {
+        printf("Failed to open ring %s.\n", ringFile != NULL ? ringFile : name);
+        exit(1);
+    }
+    hdr = mmap(0, sizeof(ShmHeader), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        printf("Failed to map ring %s.\n", ringFile != NULL ? ringFile : name);
+        exit(1);
+    }
+    if (hdr->magic != RING_MAGIC || hdr->version != RING_VERSION) {
+        printf("%s is not a version %d ring.\n", ringFile != NULL ? ringFile : name, RING_VERSION);
+        exit(1);
+    }
+    return hdr;
+}
+
+// Relaxed loads only: each counter is read on its own, a row may mix
+// counts from slightly different moments
+void TakeSnap(SideStats* stats, StatSnap* snap)
+{
+    snap->items = atomic_load_explicit(&stats->items, memory_order_relaxed);
+    snap->stalls = atomic_load_explicit(&stats->stalls, memory_order_relaxed);
+    snap->spins = atomic_load_explicit(&stats->spins, memory_order_relaxed);
+    snap->sleeps = atomic_load_explicit(&stats->sleeps, memory_order_relaxed);
+    for (int b = 0; b < DEPTH_BUCKETS; b++) {
+        snap->depthHist[b] = atomic_load_explicit(&stats->depthHist[b], memory_order_relaxed);
+    }
+}
+
+void PrintHeading()
+{
+    printf("%8s %10s %12s %12s %10s %10s %12s %12s %9s %9s\n", "time(s)", "depth",
+           "prod/s", "cons/s", "full/s", "empty/s", "pspin/s", "cspin/s", "psleep/s", "csleep/s");
+}
+
+// One row of rates over the last secs seconds, plus the depth right now
+void PrintRow(double at, StatSnap* prod, StatSnap* prodPrev, StatSnap* cons, StatSnap* consPrev, double secs)
+{
+    unsigned int depth = atomic_load(&gHdr->in) - atomic_load(&gHdr->out);
+
+    printf("%8.1f %10u %12.0f %12.0f %10.0f %10.0f %12.0f %12.0f %9.0f %9.0f\n", at, depth,
+           (prod->items - prodPrev->items) / secs, (cons->items - consPrev->items) / secs,
+           (prod->stalls - prodPrev->stalls) / secs, (cons->stalls - consPrev->stalls) / secs,
+           (prod->spins - prodPrev->spins) / secs, (cons->spins - consPrev->spins) / secs,
+           (prod->sleeps - prodPrev->sleeps) / secs, (cons->sleeps - consPrev->sleeps) / secs);
+    fflush(stdout);
+}
+
+// Share of the depth samples from both sides in each eighth of the ring
+void PrintDepthHist(StatSnap* prod, StatSnap* cons)
+{
+    unsigned long total = 0;
+
+    for (int b = 0; b < DEPTH_BUCKETS; b++) {
+        total += prod->depthHist[b] + cons->depthHist[b];
+    }
+    printf("Depth histogram (%lu samples):\n", total);
+    if (total == 0) {
+        return;
+    }
+    for (int b = 0; b < DEPTH_BUCKETS; b++) {
+        unsigned long cnt = prod->depthHist[b] + cons->depthHist[b];
+        printf("  %s%d/8 full: %6.2f%%\n", b == DEPTH_BUCKETS - 1 ? "" : ">=", b, 100.0 * cnt / total);
+    }
+}
+
+long GetMicroTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void OnSignal(int sig)
+{
+    (void)sig;
+    gStop = 1;
+}